@@ -0,0 +1,137 @@
+#include "avl.h"
+
+static uint32_t avl_depth(AVLNode *node) {
+    return node ? node->depth : 0;
+}
+
+static void avl_update(AVLNode *node) {
+    uint32_t l = avl_depth(node->left);
+    uint32_t r = avl_depth(node->right);
+    node->depth = 1 + (l > r ? l : r);
+}
+
+static AVLNode *rot_left(AVLNode *node) {
+    AVLNode *new_node = node->right;
+    if (new_node->left) {
+        new_node->left->parent = node;
+    }
+    node->right = new_node->left;
+    new_node->left = node;
+    new_node->parent = node->parent;
+    node->parent = new_node;
+    avl_update(node);
+    avl_update(new_node);
+    return new_node;
+}
+
+static AVLNode *rot_right(AVLNode *node) {
+    AVLNode *new_node = node->left;
+    if (new_node->right) {
+        new_node->right->parent = node;
+    }
+    node->left = new_node->right;
+    new_node->right = node;
+    new_node->parent = node->parent;
+    node->parent = new_node;
+    avl_update(node);
+    avl_update(new_node);
+    return new_node;
+}
+
+// the left subtree is 2 levels deeper than the right one
+static AVLNode *avl_fix_left(AVLNode *root) {
+    if (avl_depth(root->left->left) < avl_depth(root->left->right)) {
+        root->left = rot_left(root->left);
+    }
+    return rot_right(root);
+}
+
+// the right subtree is 2 levels deeper than the left one
+static AVLNode *avl_fix_right(AVLNode *root) {
+    if (avl_depth(root->right->right) < avl_depth(root->right->left)) {
+        root->right = rot_right(root->right);
+    }
+    return rot_left(root);
+}
+
+AVLNode *avl_fix(AVLNode *node) {
+    while (true) {
+        avl_update(node);
+        uint32_t l = avl_depth(node->left);
+        uint32_t r = avl_depth(node->right);
+
+        // remember where node hangs off its parent, rotations replace it
+        AVLNode **from = NULL;
+        if (node->parent) {
+            from = node->parent->left == node
+                ? &node->parent->left
+                : &node->parent->right;
+        }
+
+        if (l == r + 2) {
+            node = avl_fix_left(node);
+        } else if (l + 2 == r) {
+            node = avl_fix_right(node);
+        }
+
+        if (!from) {
+            return node;
+        }
+        *from = node;
+        node = node->parent;
+    }
+}
+
+AVLNode *avl_del(AVLNode *node) {
+    if (node->right == NULL) {
+        // no right subtree, replace node with its left subtree
+        AVLNode *parent = node->parent;
+        if (node->left) {
+            node->left->parent = parent;
+        }
+        if (!parent) {
+            return node->left;
+        }
+        AVLNode **from = parent->left == node ? &parent->left : &parent->right;
+        *from = node->left;
+        return avl_fix(parent);
+    }
+
+    // swap node with its successor, which has no left child
+    AVLNode *victim = node->right;
+    while (victim->left) {
+        victim = victim->left;
+    }
+    AVLNode *root = avl_del(victim);
+
+    *victim = *node;
+    if (victim->left) {
+        victim->left->parent = victim;
+    }
+    if (victim->right) {
+        victim->right->parent = victim;
+    }
+    AVLNode *parent = node->parent;
+    if (!parent) {
+        return victim;
+    }
+    AVLNode **from = parent->left == node ? &parent->left : &parent->right;
+    *from = victim;
+    return root;
+}
+
+AVLNode *avl_next(AVLNode *node) {
+    if (node->right) {
+        node = node->right;
+        while (node->left) {
+            node = node->left;
+        }
+        return node;
+    }
+
+    // climb until we come up from a left child
+    while (node->parent && node->parent->right == node) {
+        node = node->parent;
+    }
+    return node->parent;
+}
@@ -0,0 +1,98 @@
+#pragma once
+
+#include <stddef.h>
+#include <stdint.h>
+#include <string_view>
+
+/**
+ * Intrusive AVL tree.
+ *
+ * Like the hashmap, items embed an AVLNode. The core only knows about the
+ * tree shape, the OrderedIndex template walks it using the item's key.
+ */
+
+struct AVLNode {
+    uint32_t depth = 0;
+    AVLNode *left = NULL;
+    AVLNode *right = NULL;
+    AVLNode *parent = NULL;
+};
+
+inline void avl_init(AVLNode *node) {
+    node->depth = 1;
+    node->left = node->right = node->parent = NULL;
+}
+
+// rebalances from node up to the root after an insert, returns the new root
+AVLNode *avl_fix(AVLNode *node);
+
+// unlinks node from its tree, returns the new root
+AVLNode *avl_del(AVLNode *node);
+
+// in-order successor, NULL for the last node
+AVLNode *avl_next(AVLNode *node);
+
+/**
+ * Ordered index over items of type T, sorted by the key KeyOf returns.
+ *
+ * It does not own the items, so the same item can live in an IntrusiveMap
+ * and in an OrderedIndex at once.
+ */
+template <typename T, AVLNode T::*Node, typename KeyOf>
+class OrderedIndex {
+public:
+    static T *from_node(AVLNode *node) {
+        size_t offset = (size_t)&(((T *)0)->*Node);
+        return (T *)((char *)node - offset);
+    }
+
+    // the caller must make sure the key is not present
+    void insert(T *item) {
+        std::string_view key = KeyOf{}(*item);
+        AVLNode *node = &(item->*Node);
+        avl_init(node);
+
+        AVLNode *parent = NULL;
+        AVLNode **from = &root;
+        while (*from) {
+            parent = *from;
+            from = key < KeyOf{}(*from_node(parent)) ? &parent->left : &parent->right;
+        }
+        *from = node;
+        node->parent = parent;
+        root = avl_fix(node);
+        count++;
+    }
+
+    void erase(T *item) {
+        root = avl_del(&(item->*Node));
+        count--;
+    }
+
+    // first item whose key is >= key
+    T *lower_bound(std::string_view key) {
+        AVLNode *cur = root;
+        AVLNode *found = NULL;
+        while (cur) {
+            if (KeyOf{}(*from_node(cur)) < key) {
+                cur = cur->right;
+            } else {
+                found = cur;
+                cur = cur->left;
+            }
+        }
+        return found ? from_node(found) : NULL;
+    }
+
+    T *next(T *item) {
+        AVLNode *node = avl_next(&(item->*Node));
+        return node ? from_node(node) : NULL;
+    }
+
+    size_t size() const {
+        return count;
+    }
+
+    AVLNode *root = NULL;
+    size_t count = 0;
+};
@@ -0,0 +1,772 @@
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdio.h>
+#include <time.h>
+#include <malloc.h>
+#include <arpa/inet.h>
+#include <shared_mutex>
+#include <string>
+#include <string_view>
+#include <thread>
+#include <vector>
+#include <list>
+#include "hashmap.h"
+#include "chashmap.h"
+#include "hashobj.h"
+#include "quicklist.h"
+#include "hyperloglog.h"
+#include "lzf.h"
+#include "kvclient.h"
+#include "proto.h"
+
+/**
+ * In-process micro benchmarks for the data structures behind the server.
+ *
+ * usage: ./bench [name...]
+ * runs every benchmark when no name is given.
+ *
+ * "chashmap" runs on 1 to 8 threads, so it only shows scaling on a machine
+ * with that many cores.
+ *
+ * "net" is the exception, it talks to a running server over tcp on port
+ * 3535 and over the unix socket at $SAKANAKV_SOCKET (/tmp/sakanakv.sock by
+ * default), skipping whichever isn't there.
+ */
+
+// macro to convert Nodes to Entries
+#define container_of(ptr, type, member) ({                  \
+    const typeof( ((type *)0)->member ) *__mptr = (ptr);    \
+    (type *)( (char *)__mptr - offsetof(type, member) );})
+
+static uint64_t now_ns() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000 + (uint64_t)ts.tv_nsec;
+}
+
+// keeps the optimiser from throwing away benchmark results
+static volatile uint64_t sink;
+
+static void report(const char *name, size_t ops, uint64_t elapsed_ns) {
+    printf("%-36s %10.1f ns/op %12.0f ops/s\n",
+        name,
+        (double)elapsed_ns / (double)ops,
+        (double)ops * 1e9 / (double)elapsed_ns);
+}
+
+// bytes currently allocated on the heap
+static size_t heap_used() {
+    struct mallinfo2 mi = mallinfo2();
+    return mi.uordblks + mi.hblkhd;
+}
+
+static void report_mem(const char *name, size_t objects, size_t bytes) {
+    printf("%-36s %10.1f bytes/item\n", name, (double)bytes / (double)objects);
+}
+
+static std::vector<std::string> make_keys(size_t n, const char *prefix) {
+    std::vector<std::string> keys;
+    keys.reserve(n);
+    char buf[64];
+    for (size_t i = 0; i < n; i++) {
+        snprintf(buf, sizeof(buf), "%s%zu", prefix, i);
+        keys.push_back(buf);
+    }
+    return keys;
+}
+
+// same layout as the server's Entry
+struct BenchEntry {
+    HashTableNode node;
+    std::string key;
+    std::string value;
+};
+
+// the old comparison, only reachable through a function pointer
+static bool entry_eq(HashTableNode *node1, HashTableNode *node2) {
+    BenchEntry *entry1 = container_of(node1, BenchEntry, node);
+    BenchEntry *entry2 = container_of(node2, BenchEntry, node);
+    return node1->hashcode == node2->hashcode && entry1->key == entry2->key;
+}
+
+struct BenchEntryEq {
+    bool operator()(const BenchEntry &entry, std::string_view key) const {
+        return entry.key == key;
+    }
+};
+
+typedef IntrusiveMap<BenchEntry, &BenchEntry::node, StringViewHash, BenchEntryEq> BenchMap;
+
+// lookups through hm_get with a function pointer compare vs the template
+static void bench_hashmap() {
+    const size_t n = 1 << 18;
+    const size_t rounds = 8;
+    std::vector<std::string> keys = make_keys(n, "user:");
+    std::vector<BenchEntry> entries(n);
+
+    // C-style map, every lookup builds a throwaway entry
+    HashMap c_map;
+    for (size_t i = 0; i < n; i++) {
+        entries[i].key = keys[i];
+        entries[i].node.hashcode = hash_string(
+            (uint8_t *)keys[i].data(), keys[i].size());
+        hm_put(&c_map, &entries[i].node);
+    }
+    uint64_t found = 0;
+    uint64_t start = now_ns();
+    for (size_t r = 0; r < rounds; r++) {
+        for (size_t i = 0; i < n; i++) {
+            BenchEntry key;
+            key.key = keys[i];
+            key.node.hashcode = hash_string((uint8_t *)key.key.data(), key.key.size());
+            found += hm_get(&c_map, &key.node, &entry_eq) != NULL;
+        }
+    }
+    report("hashmap/get fnptr+temp entry", n * rounds, now_ns() - start);
+
+    start = now_ns();
+    for (size_t r = 0; r < rounds; r++) {
+        for (size_t i = 0; i < n; i++) {
+            BenchEntry &key = entries[i];
+            found += hm_get(&c_map, &key.node, &entry_eq) != NULL;
+        }
+    }
+    report("hashmap/get fnptr (prehashed)", n * rounds, now_ns() - start);
+    hm_destroy(&c_map);
+
+    // templated map, lookups by string_view
+    BenchMap t_map;
+    for (size_t i = 0; i < n; i++) {
+        t_map.put(&entries[i], entries[i].key);
+    }
+    start = now_ns();
+    for (size_t r = 0; r < rounds; r++) {
+        for (size_t i = 0; i < n; i++) {
+            found += t_map.get(keys[i]) != NULL;
+        }
+    }
+    report("hashmap/get template", n * rounds, now_ns() - start);
+
+    start = now_ns();
+    for (size_t r = 0; r < rounds; r++) {
+        for (size_t i = 0; i < n; i++) {
+            found += t_map.get(keys[i], entries[i].node.hashcode) != NULL;
+        }
+    }
+    report("hashmap/get template (prehashed)", n * rounds, now_ns() - start);
+    t_map.destroy();
+
+    // every key in a group shares a hashcode, so the hashcode check in
+    // ht_lookup passes and each lookup calls the compare ~group/2 times.
+    // this is where inlining it instead of calling through a pointer shows.
+    const size_t group = 64;
+    const size_t colliding = 1 << 12;
+    for (size_t i = 0; i < colliding; i++) {
+        entries[i].node.hashcode = i % (colliding / group);
+        hm_put(&c_map, &entries[i].node);
+    }
+    start = now_ns();
+    for (size_t r = 0; r < rounds; r++) {
+        for (size_t i = 0; i < colliding; i++) {
+            found += hm_get(&c_map, &entries[i].node, &entry_eq) != NULL;
+        }
+    }
+    report("hashmap/get fnptr (collisions)", colliding * rounds, now_ns() - start);
+    hm_destroy(&c_map);
+
+    for (size_t i = 0; i < colliding; i++) {
+        t_map.put(&entries[i], entries[i].node.hashcode);
+    }
+    start = now_ns();
+    for (size_t r = 0; r < rounds; r++) {
+        for (size_t i = 0; i < colliding; i++) {
+            found += t_map.get(keys[i], entries[i].node.hashcode) != NULL;
+        }
+    }
+    report("hashmap/get template (collisions)", colliding * rounds, now_ns() - start);
+    t_map.destroy();
+
+    sink = found;
+}
+
+struct BenchHashEntry {
+    HashTableNode node;
+    std::string key;
+    HashObj *hash = NULL;
+};
+
+struct BenchHashEntryEq {
+    bool operator()(const BenchHashEntry &entry, std::string_view key) const {
+        return entry.key == key;
+    }
+};
+
+typedef IntrusiveMap<BenchHashEntry, &BenchHashEntry::node, StringViewHash, BenchHashEntryEq>
+    BenchHashMap;
+
+static const char *PROFILE_FIELDS[] = {
+    "name", "email", "country", "city", "plan", "created_at", "last_login", "lang",
+};
+const size_t NUM_PROFILE_FIELDS = sizeof(PROFILE_FIELDS) / sizeof(PROFILE_FIELDS[0]);
+
+// stores user profiles as one key per field vs one hash per user
+static void bench_hashobj() {
+    const size_t n = 100000;
+    std::vector<std::string> users = make_keys(n, "user:");
+    const std::string value = "some-value-0123"; // 15 bytes, past the SSO limit
+
+    // one top-level key per field
+    size_t before = heap_used();
+    BenchMap flat;
+    for (size_t i = 0; i < n; i++) {
+        for (const char *field : PROFILE_FIELDS) {
+            BenchEntry *entry = new BenchEntry();
+            entry->key = users[i] + ":" + field;
+            entry->value = value;
+            flat.put(entry, entry->key);
+        }
+    }
+    size_t flat_bytes = heap_used() - before;
+    report_mem("hashobj/key per field", n, flat_bytes);
+    flat.foreach([](BenchEntry *entry) { delete entry; });
+    flat.destroy();
+
+    // one key per user holding a hash, packed and then forced into maps
+    HashObjLimits packed_limits;
+    HashObjLimits map_limits;
+    map_limits.max_packed_entries = 0;
+    for (const HashObjLimits *limits : {&packed_limits, &map_limits}) {
+        before = heap_used();
+        BenchHashMap hashes;
+        for (size_t i = 0; i < n; i++) {
+            BenchHashEntry *entry = new BenchHashEntry();
+            entry->key = users[i];
+            entry->hash = new HashObj();
+            for (const char *field : PROFILE_FIELDS) {
+                hobj_set(entry->hash, field, value, *limits);
+            }
+            hashes.put(entry, entry->key);
+        }
+        size_t bytes = heap_used() - before;
+        report_mem(limits == &packed_limits
+            ? "hashobj/hash per user (packed)"
+            : "hashobj/hash per user (map)", n, bytes);
+        printf("%-36s %10.1f%% saved vs key per field\n", "",
+            100.0 * (1.0 - (double)bytes / (double)flat_bytes));
+
+        std::string_view val;
+        uint64_t start = now_ns();
+        uint64_t found = 0;
+        for (size_t i = 0; i < n; i++) {
+            BenchHashEntry *entry = hashes.get(users[i]);
+            found += hobj_get(entry->hash, PROFILE_FIELDS[i % NUM_PROFILE_FIELDS], &val);
+        }
+        report(limits == &packed_limits
+            ? "hashobj/hget (packed)"
+            : "hashobj/hget (map)", n, now_ns() - start);
+        sink = found;
+
+        hashes.foreach([](BenchHashEntry *entry) {
+            hobj_destroy(entry->hash);
+            delete entry->hash;
+            delete entry;
+        });
+        hashes.destroy();
+    }
+}
+
+// push/pop throughput and memory of the chunked list vs a node per element
+static void bench_quicklist() {
+    const size_t n = 1000000;
+    std::vector<std::string> vals = make_keys(n, "job:00000000");
+
+    size_t before = heap_used();
+    QuickList ql;
+    uint64_t start = now_ns();
+    for (size_t i = 0; i < n; i++) {
+        ql_push_back(&ql, vals[i]);
+    }
+    report("quicklist/rpush", n, now_ns() - start);
+    report_mem("quicklist/memory", n, heap_used() - before);
+
+    uint64_t total = 0;
+    start = now_ns();
+    ql_foreach_range(&ql, 0, n, [&total](std::string_view val) {
+        total += val.size();
+    });
+    report("quicklist/lrange scan", n, now_ns() - start);
+
+    std::string out;
+    start = now_ns();
+    while (ql_pop_front(&ql, &out)) {
+        total += out.size();
+    }
+    report("quicklist/lpop", n, now_ns() - start);
+
+    start = now_ns();
+    for (size_t i = 0; i < n; i++) {
+        ql_push_front(&ql, vals[i]);
+    }
+    report("quicklist/lpush", n, now_ns() - start);
+    start = now_ns();
+    while (ql_pop_back(&ql, &out)) {
+        total += out.size();
+    }
+    report("quicklist/rpop", n, now_ns() - start);
+    ql_destroy(&ql);
+
+    // one heap node per element
+    before = heap_used();
+    std::list<std::string> nodes;
+    start = now_ns();
+    for (size_t i = 0; i < n; i++) {
+        nodes.push_back(vals[i]);
+    }
+    report("std::list/push_back", n, now_ns() - start);
+    report_mem("std::list/memory", n, heap_used() - before);
+
+    start = now_ns();
+    for (const std::string &val : nodes) {
+        total += val.size();
+    }
+    report("std::list/scan", n, now_ns() - start);
+
+    start = now_ns();
+    while (!nodes.empty()) {
+        out = std::move(nodes.front());
+        nodes.pop_front();
+        total += out.size();
+    }
+    report("std::list/pop_front", n, now_ns() - start);
+
+    sink = total;
+}
+
+// bytes held by the registers, heap_used() would also count the freed
+// sparse arrays still parked in malloc's thread cache
+static size_t hll_bytes(HyperLogLog *hll) {
+    return hll->encoding == HLL_DENSE
+        ? HLL_DENSE_BYTES + 1
+        : hll->sparse.capacity() * sizeof(uint32_t);
+}
+
+// add, count and merge throughput plus the error of the estimate
+static void bench_hyperloglog() {
+    const size_t n = 1000000;
+    std::vector<std::string> ids = make_keys(n, "visitor:");
+
+    HyperLogLog hll;
+    uint64_t start = now_ns();
+    for (size_t i = 0; i < n; i++) {
+        hll_add(&hll, ids[i]);
+    }
+    report("hyperloglog/pfadd", n, now_ns() - start);
+    report_mem("hyperloglog/memory (dense)", 1, hll_bytes(&hll));
+
+    const size_t rounds = 1000;
+    uint64_t count = 0;
+    start = now_ns();
+    for (size_t i = 0; i < rounds; i++) {
+        count += hll_count(&hll);
+    }
+    report("hyperloglog/pfcount (dense)", rounds, now_ns() - start);
+    printf("%-36s %10.2f%% error at %zu\n", "",
+        100.0 * ((double)(count / rounds) - (double)n) / (double)n, n);
+
+    // merge many page HLLs with ~20k visitors each
+    const size_t pages = 64;
+    std::vector<HyperLogLog> page_hlls(pages);
+    for (size_t p = 0; p < pages; p++) {
+        for (size_t i = 0; i < 20000; i++) {
+            hll_add(&page_hlls[p], ids[(p * 15000 + i) % n]);
+        }
+    }
+    HllRegisters regs;
+    start = now_ns();
+    for (size_t r = 0; r < rounds / 10; r++) {
+        memset(regs.regs, 0, sizeof(regs.regs));
+        for (HyperLogLog &page : page_hlls) {
+            hll_merge_into(&regs, &page);
+        }
+    }
+    report("hyperloglog/pfmerge per source", pages * rounds / 10, now_ns() - start);
+    size_t expected = (pages - 1) * 15000 + 20000;
+    printf("%-36s %10.2f%% error at %zu\n", "",
+        100.0 * ((double)hll_estimate(&regs) - (double)expected) / (double)expected,
+        expected);
+
+    // small cardinalities stay sparse
+    HyperLogLog small;
+    for (size_t i = 0; i < 500; i++) {
+        hll_add(&small, ids[i]);
+    }
+    report_mem("hyperloglog/memory (sparse, 500)", 1, hll_bytes(&small));
+    printf("%-36s %10.2f%% error at 500\n", "",
+        100.0 * ((double)hll_count(&small) - 500.0) / 500.0);
+
+    hll_destroy(&small);
+    for (HyperLogLog &page : page_hlls) {
+        hll_destroy(&page);
+    }
+    hll_destroy(&hll);
+    sink = count;
+}
+
+// a json document of roughly len bytes that looks like a user record
+static std::string make_json(size_t len, uint32_t seed) {
+    std::string doc = "{";
+    char buf[160];
+    for (uint32_t i = 0; doc.size() < len; i++) {
+        seed = seed * 1103515245 + 12345;
+        snprintf(buf, sizeof(buf),
+            "\"event_%u\":{\"type\":\"%s\",\"ts\":%u,\"ok\":%s,\"score\":%u},",
+            i, (seed >> 8) % 3 ? "page_view" : "click", 1700000000 + (seed >> 4) % 100000,
+            seed & 1 ? "true" : "false", (seed >> 16) % 1000);
+        doc += buf;
+    }
+    doc.back() = '}';
+    return doc;
+}
+
+// memory saved vs time added by compressing values on set
+static void bench_lzf() {
+    const size_t sizes[] = {1024, 2048, 4096, 16384};
+    const size_t n = 2000;
+    for (size_t size : sizes) {
+        std::vector<std::string> docs;
+        for (size_t i = 0; i < n; i++) {
+            docs.push_back(make_json(size, (uint32_t) i));
+        }
+        std::vector<std::string> packed(n, std::string(size * 2, '\0'));
+
+        size_t raw_bytes = 0;
+        size_t packed_bytes = 0;
+        uint64_t start = now_ns();
+        for (size_t i = 0; i < n; i++) {
+            size_t len = lzf_compress(
+                (const uint8_t *)docs[i].data(), docs[i].size(),
+                (uint8_t *)&packed[i][0], packed[i].size());
+            packed[i].resize(len);
+            raw_bytes += docs[i].size();
+            packed_bytes += len;
+        }
+        uint64_t compress_ns = now_ns() - start;
+
+        std::string out;
+        start = now_ns();
+        for (size_t i = 0; i < n; i++) {
+            out.resize(docs[i].size());
+            lzf_decompress(
+                (const uint8_t *)packed[i].data(), packed[i].size(),
+                (uint8_t *)&out[0], out.size());
+        }
+        uint64_t decompress_ns = now_ns() - start;
+
+        // what a plain get costs for the same bytes
+        start = now_ns();
+        for (size_t i = 0; i < n; i++) {
+            out.assign(docs[i]);
+        }
+        uint64_t copy_ns = now_ns() - start;
+        sink = out.size();
+
+        char name[64];
+        snprintf(name, sizeof(name), "lzf/%zu bytes compress", size);
+        report(name, n, compress_ns);
+        snprintf(name, sizeof(name), "lzf/%zu bytes decompress", size);
+        report(name, n, decompress_ns);
+        snprintf(name, sizeof(name), "lzf/%zu bytes copy", size);
+        report(name, n, copy_ns);
+        printf("%-36s %10.2fx ratio, %.0f bytes saved per value\n", "",
+            (double) raw_bytes / (double) packed_bytes,
+            (double)(raw_bytes - packed_bytes) / (double) n);
+    }
+}
+
+// encoded size and parse cost of typical requests in both framings. v1
+// pays for the name lookup the server does on top of parsing, v2 for
+// decoding its varint length prefix.
+static void bench_proto() {
+    const size_t n = 1 << 20;
+    const std::string key = "user:1234567890"; // 15 bytes
+    const std::vector<std::vector<std::string>> reqs = {
+        {"get", key},
+        {"set", key, std::string(32, 'v')},
+        {"hset", key, "email", "someone@example.com"},
+        {"pfcount", key},
+    };
+    char name[64];
+    for (const std::vector<std::string> &req : reqs) {
+        std::string v1;
+        std::string v2;
+        proto_encode_v1(&v1, req);
+        proto_encode_v2(&v2, req);
+        printf("%-36s %4zu bytes v1 %4zu bytes v2 (%.0f%% smaller)\n",
+            ("proto/" + req[0] + " size").c_str(), v1.size(), v2.size(),
+            100.0 - 100.0 * (double) v2.size() / (double) v1.size());
+
+        const uint8_t *data = (const uint8_t *) v1.data();
+        uint64_t total = 0;
+        uint64_t start = now_ns();
+        for (size_t i = 0; i < n; i++) {
+            std::vector<std::string> cmd;
+            uint32_t len = 0;
+            memcpy(&len, data, 4);
+            proto_parse_v1(data + 4, len, cmd);
+            total += (uint64_t) proto_opcode(cmd[0].c_str()) + cmd.size();
+        }
+        snprintf(name, sizeof(name), "proto/%s parse v1", req[0].c_str());
+        report(name, n, now_ns() - start);
+
+        data = (const uint8_t *) v2.data();
+        start = now_ns();
+        for (size_t i = 0; i < n; i++) {
+            std::vector<std::string> cmd;
+            uint32_t len = 0;
+            uint32_t op = 0;
+            int32_t header = varint_get(data, v2.size(), &len);
+            proto_parse_v2(data + header, len, &op, cmd);
+            total += op + cmd.size();
+        }
+        snprintf(name, sizeof(name), "proto/%s parse v2", req[0].c_str());
+        report(name, n, now_ns() - start);
+        sink = total;
+    }
+}
+
+// true if the request didn't make it or the server answered with an
+// error, either way the timing is worthless
+static bool reply_failed(int32_t err, const std::string &res) {
+    return err || res.empty() || res[0] == SER_ERR;
+}
+
+// round trips of n small requests, one at a time and then pipelined
+static void bench_transport(const char *transport, KVClient *client) {
+    const size_t n = 20000;
+    const size_t depth = 32;
+    std::vector<std::string> keys = make_keys(1000, "bench:key:");
+    std::string val(32, 'v');
+    std::string res;
+    char name[64];
+
+    uint64_t start = now_ns();
+    for (size_t i = 0; i < n; i++) {
+        if (reply_failed(kv_call(client, {"set", keys[i % keys.size()], val}, &res), res)) {
+            printf("%s: request failed\n", transport);
+            return;
+        }
+    }
+    snprintf(name, sizeof(name), "net/%s set latency", transport);
+    report(name, n, now_ns() - start);
+
+    start = now_ns();
+    for (size_t i = 0; i < n; i++) {
+        if (reply_failed(kv_call(client, {"get", keys[i % keys.size()]}, &res), res)) {
+            printf("%s: request failed\n", transport);
+            return;
+        }
+    }
+    snprintf(name, sizeof(name), "net/%s get latency", transport);
+    report(name, n, now_ns() - start);
+
+    // keep depth requests in flight, small enough to fit the server's
+    // read buffer so it never stalls on us
+    start = now_ns();
+    for (size_t i = 0; i < n; i += depth) {
+        for (size_t j = 0; j < depth; j++) {
+            if (kv_send_req(client, {"get", keys[(i + j) % keys.size()]})) {
+                printf("%s: request failed\n", transport);
+                return;
+            }
+        }
+        for (size_t j = 0; j < depth; j++) {
+            if (reply_failed(kv_read_res(client, &res), res)) {
+                printf("%s: request failed\n", transport);
+                return;
+            }
+        }
+    }
+    snprintf(name, sizeof(name), "net/%s get pipelined x%zu", transport, depth);
+    report(name, n, now_ns() - start);
+    sink = res.size();
+}
+
+static void bench_net() {
+    KVClient client;
+    if (kv_connect_tcp(&client, INADDR_LOOPBACK, 3535) == 0) {
+        bench_transport("tcp", &client);
+        if (kv_hello(&client, PROTO_V2) == 0) {
+            bench_transport("tcp v2", &client);
+        }
+        kv_close(&client);
+    } else {
+        printf("net/tcp: no server on 127.0.0.1:3535, skipped\n");
+    }
+
+    const char *path = getenv("SAKANAKV_SOCKET");
+    path = path ? path : "/tmp/sakanakv.sock";
+    if (kv_connect_unix(&client, path) == 0) {
+        bench_transport("unix", &client);
+        if (kv_hello(&client, PROTO_V2) == 0) {
+            bench_transport("unix v2", &client);
+        }
+        kv_close(&client);
+    } else {
+        printf("net/unix: no server on %s, skipped\n", path);
+    }
+}
+
+// same layout as the server's SharedEntry
+struct BenchShared {
+    std::string key;
+    std::string value;
+};
+
+struct BenchSharedEq {
+    bool operator()(const BenchShared &entry, std::string_view key) const {
+        return entry.key == key;
+    }
+};
+
+typedef ConcurrentHashMap<BenchShared, StringViewHash, BenchSharedEq> BenchCMap;
+
+// runs fn(thread index) on n threads, reports and returns the aggregate
+// ops/s over all of them
+template <typename F>
+static double run_threads(const char *name, size_t n, size_t ops_per_thread, F fn) {
+    std::vector<std::thread> threads;
+    uint64_t start = now_ns();
+    for (size_t t = 0; t < n; t++) {
+        threads.emplace_back(fn, t);
+    }
+    for (std::thread &thread : threads) {
+        thread.join();
+    }
+    uint64_t elapsed_ns = now_ns() - start;
+    report(name, n * ops_per_thread, elapsed_ns);
+    return (double)(n * ops_per_thread) * 1e9 / (double)elapsed_ns;
+}
+
+// 95% gets and 5% sets on random existing keys, the lock-free map vs the
+// single threaded one behind a reader-writer lock. in both a set swaps in
+// a new entry and frees the old one, they only differ in when.
+static void bench_chashmap() {
+    const size_t n = 1 << 16;
+    const size_t ops = 1 << 20; // per thread
+    std::vector<std::string> keys = make_keys(n, "user:");
+    std::string val(32, 'v');
+    char name[64];
+
+    BenchMap locked;
+    std::shared_mutex mu;
+    for (size_t i = 0; i < n; i++) {
+        BenchEntry *entry = new BenchEntry();
+        entry->key = keys[i];
+        entry->value = val;
+        locked.put(entry, keys[i]);
+    }
+    BenchCMap cmap;
+    for (size_t i = 0; i < n; i++) {
+        cmap.put(new BenchShared{keys[i], val}, keys[i]);
+    }
+
+    const size_t counts[] = {1, 2, 4, 8};
+    double rwlock_rate[4], epoch_rate[4];
+    for (size_t c = 0; c < 4; c++) {
+        size_t threads = counts[c];
+        std::vector<uint64_t> found_by(threads); // summed after the join
+        snprintf(name, sizeof(name), "chashmap/rwlock 95%% get x%zu", threads);
+        rwlock_rate[c] = run_threads(name, threads, ops, [&](size_t t) {
+            uint64_t x = 0x9e3779b97f4a7c15ull * (t + 1);
+            uint64_t found = 0;
+            for (size_t i = 0; i < ops; i++) {
+                x ^= x << 13, x ^= x >> 7, x ^= x << 17;
+                const std::string &key = keys[x % n];
+                if (x % 100 < 5) {
+                    BenchEntry *entry = new BenchEntry();
+                    entry->key = key;
+                    entry->value = val;
+                    BenchEntry *old = NULL;
+                    {
+                        std::unique_lock<std::shared_mutex> lock(mu);
+                        old = locked.del(key);
+                        locked.put(entry, key);
+                    }
+                    delete old;
+                } else {
+                    std::shared_lock<std::shared_mutex> lock(mu);
+                    found += locked.get(key)->value.size();
+                }
+            }
+            found_by[t] = found;
+        });
+        for (uint64_t found : found_by) {
+            sink += found;
+        }
+
+        snprintf(name, sizeof(name), "chashmap/epoch 95%% get x%zu", threads);
+        epoch_rate[c] = run_threads(name, threads, ops, [&](size_t t) {
+            uint64_t x = 0x9e3779b97f4a7c15ull * (t + 1);
+            uint64_t found = 0;
+            for (size_t i = 0; i < ops; i++) {
+                x ^= x << 13, x ^= x >> 7, x ^= x << 17;
+                const std::string &key = keys[x % n];
+                if (x % 100 < 5) {
+                    BenchCMap::retire(cmap.put(new BenchShared{key, val}, key));
+                } else {
+                    EpochGuard guard;
+                    found += cmap.get(key)->value.size();
+                }
+            }
+            epoch_reclaim();
+            found_by[t] = found;
+        });
+        for (uint64_t found : found_by) {
+            sink += found;
+        }
+    }
+
+    // scaling only means something with at least as many cores as threads
+    printf("aggregate ops/s on %u cpus:\n", std::thread::hardware_concurrency());
+    printf("%8s %14s %14s %12s\n", "threads", "rwlock", "epoch", "epoch vs x1");
+    for (size_t c = 0; c < 4; c++) {
+        printf("%8zu %14.0f %14.0f %11.2fx\n",
+            counts[c], rwlock_rate[c], epoch_rate[c], epoch_rate[c] / epoch_rate[0]);
+    }
+
+    locked.foreach([](BenchEntry *entry) { delete entry; });
+    locked.destroy();
+    cmap.destroy();
+}
+
+struct Bench {
+    const char *name;
+    void (*run)();
+};
+
+static const Bench BENCHES[] = {
+    {"hashmap", &bench_hashmap},
+    {"hashobj", &bench_hashobj},
+    {"quicklist", &bench_quicklist},
+    {"hyperloglog", &bench_hyperloglog},
+    {"lzf", &bench_lzf},
+    {"proto", &bench_proto},
+    {"chashmap", &bench_chashmap},
+    {"net", &bench_net},
+};
+
+int main(int argc, char **argv) {
+    for (const Bench &bench : BENCHES) {
+        bool selected = argc < 2;
+        for (int i = 1; i < argc; i++) {
+            if (strcmp(argv[i], bench.name) == 0) {
+                selected = true;
+            }
+        }
+        if (selected) {
+            bench.run();
+        }
+    }
+    return 0;
+}
@@ -1,3 +1,5 @@
 #!/usr/bin/env bash
-g++ client.cpp -o client
-g++ server.cpp hashmap.cpp -o server 
+g++ client.cpp kvclient.cpp proto.cpp hashmap.cpp -o client
+g++ -pthread server.cpp hashmap.cpp epoch.cpp chashmap.cpp hashobj.cpp quicklist.cpp hyperloglog.cpp lzf.cpp avl.cpp tracking.cpp iopool.cpp valuelog.cpp trace.cpp proto.cpp -o server
+g++ -O2 -pthread bench.cpp epoch.cpp chashmap.cpp kvclient.cpp proto.cpp hashmap.cpp hashobj.cpp quicklist.cpp hyperloglog.cpp lzf.cpp -o bench
+g++ -O2 replay.cpp kvclient.cpp proto.cpp hashmap.cpp trace.cpp -o replay
@@ -0,0 +1,147 @@
+#include "chashmap.h"
+
+static CHTable *cht_new(size_t n) {
+    CHTable *t = new CHTable();
+    t->slots = new std::atomic<CHNode *>[n];
+    for (size_t i = 0; i < n; i++) {
+        t->slots[i].store(NULL, std::memory_order_relaxed);
+    }
+    t->mask = n - 1;
+    return t;
+}
+
+static void cht_free(void *ptr) {
+    CHTable *t = (CHTable *) ptr;
+    delete[] t->slots;
+    delete t;
+}
+
+static void state_free(void *ptr) {
+    delete (CHState *) ptr;
+}
+
+void chm_free_node(void *node) {
+    delete (CHNode *) node;
+}
+
+void chm_init(CHMap *m) {
+    CHState *st = new CHState();
+    st->newer = cht_new(CHM_INIT_SLOTS);
+    m->state.store(st, std::memory_order_release);
+}
+
+void chm_push(CHTable *t, CHNode *node) {
+    std::atomic<CHNode *> &slot = t->slots[node->hashcode & t->mask];
+    node->next.store(slot.load(std::memory_order_relaxed), std::memory_order_relaxed);
+    slot.store(node, std::memory_order_release);
+}
+
+// moves a batch of the stripe's buckets from the older table to the newer
+// one. the stripe must be locked.
+static void migrate_step(CHMap *m, size_t stripe) {
+    CHState *st = m->state.load(std::memory_order_acquire);
+    CHStripe *sp = &m->stripes[stripe];
+    if (!st->older || sp->migrated) {
+        return;
+    }
+
+    CHTable *older = st->older;
+    for (size_t i = 0; i < CHM_MIGRATE_BUCKETS && sp->migrate_pos <= older->mask; i++) {
+        std::atomic<CHNode *> &slot = older->slots[sp->migrate_pos];
+        CHNode *node = NULL;
+        while ((node = slot.load(std::memory_order_relaxed))) {
+            // the copy goes in first, a reader that misses the old node
+            // after this finds the copy
+            CHNode *copy = new CHNode();
+            copy->hashcode = node->hashcode;
+            copy->item.store(node->item.load(std::memory_order_relaxed), std::memory_order_relaxed);
+            chm_push(st->newer, copy);
+            slot.store(node->next.load(std::memory_order_relaxed), std::memory_order_release);
+            epoch_retire(node, &chm_free_node);
+        }
+        sp->migrate_pos += CHM_STRIPES;
+    }
+
+    if (sp->migrate_pos <= older->mask) {
+        return;
+    }
+    sp->migrated = true;
+    if (m->stripes_left.fetch_sub(1, std::memory_order_acq_rel) == 1) {
+        // the last stripe is done, readers only need the newer table now
+        CHState *next = new CHState();
+        next->newer = st->newer;
+        m->state.store(next, std::memory_order_release);
+        epoch_retire(st, &state_free);
+        epoch_retire(older, &cht_free);
+    }
+}
+
+// swaps in a table twice the size once there are too many items per bucket
+static void maybe_grow(CHMap *m) {
+    CHState *st = m->state.load(std::memory_order_acquire);
+    if (st->older || chm_size(m) < (st->newer->mask + 1) * CHM_MAX_LOAD) {
+        return;
+    }
+
+    // always locked in the same order, a second grower waits and rechecks
+    for (CHStripe &sp : m->stripes) {
+        sp.mu.lock();
+    }
+    st = m->state.load(std::memory_order_acquire);
+    if (!st->older && chm_size(m) >= (st->newer->mask + 1) * CHM_MAX_LOAD) {
+        for (size_t i = 0; i < CHM_STRIPES; i++) {
+            m->stripes[i].migrate_pos = i;
+            m->stripes[i].migrated = false;
+        }
+        m->stripes_left.store(CHM_STRIPES, std::memory_order_relaxed);
+
+        CHState *next = new CHState();
+        next->newer = cht_new((st->newer->mask + 1) * 2);
+        next->older = st->newer;
+        m->state.store(next, std::memory_order_release);
+        epoch_retire(st, &state_free);
+    }
+    for (CHStripe &sp : m->stripes) {
+        sp.mu.unlock();
+    }
+}
+
+void chm_after_write(CHMap *m, size_t stripe) {
+    if (m->state.load(std::memory_order_acquire)->older) {
+        {
+            std::lock_guard<std::mutex> lock(m->stripes[stripe].mu);
+            migrate_step(m, stripe);
+        }
+        // stripes nobody writes to would hold the resize up forever, so
+        // lend a hand to another one if that doesn't mean waiting
+        size_t other = m->help_pos.fetch_add(1, std::memory_order_relaxed) & (CHM_STRIPES - 1);
+        if (other != stripe && m->stripes[other].mu.try_lock()) {
+            migrate_step(m, other);
+            m->stripes[other].mu.unlock();
+        }
+        return;
+    }
+    maybe_grow(m);
+}
+
+void chm_destroy(CHMap *m, void (*free_item)(void *)) {
+    CHState *st = m->state.load(std::memory_order_relaxed);
+    for (CHTable *t : {st->older, st->newer}) {
+        if (!t) {
+            continue;
+        }
+        for (size_t i = 0; i <= t->mask; i++) {
+            CHNode *node = t->slots[i].load(std::memory_order_relaxed);
+            while (node) {
+                CHNode *next = node->next.load(std::memory_order_relaxed);
+                free_item(node->item.load(std::memory_order_relaxed));
+                delete node;
+                node = next;
+            }
+        }
+        cht_free(t);
+    }
+    delete st;
+    m->state.store(NULL, std::memory_order_relaxed);
+    m->size.store(0, std::memory_order_relaxed);
+}
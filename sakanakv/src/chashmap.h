@@ -0,0 +1,254 @@
+#pragma once
+
+#include <stddef.h>
+#include <stdint.h>
+#include <atomic>
+#include <mutex>
+#include <string_view>
+#include "epoch.h"
+
+/**
+ * Hash map for many threads, tuned for reads.
+ *
+ * Readers take no locks. They walk the chains with acquire loads inside an
+ * epoch section, and everything a writer unlinks (nodes, replaced items,
+ * old tables) goes through epoch_retire. Writers lock one of CHM_STRIPES
+ * stripes picked by the low bits of the hashcode. Tables never have fewer
+ * buckets than there are stripes, so a bucket's chain always belongs to a
+ * single stripe in every table.
+ *
+ * Resizing is incremental like HashMap's. A new table is swapped in with every
+ * stripe locked, which only happens once per doubling. After that, each
+ * write moves a few buckets of its own stripe out of the older table and
+ * helps one other stripe if it can get its lock without waiting. A node is
+ * moved by pushing a copy onto the newer table before unlinking it from
+ * the older one, and readers search the older table first, so a reader
+ * can't miss a key that is being moved. The pair of tables is published as
+ * one CHState. A lookup that misses while that pair changed under it
+ * starts over.
+ *
+ * Unlike IntrusiveMap the nodes are not intrusive: a node can't sit in two
+ * chains at once, and moving it in place would send a reader walking the
+ * old chain off into the new one.
+ */
+
+struct CHNode {
+    std::atomic<CHNode *> next{NULL};
+    uint64_t hashcode = 0;
+    std::atomic<void *> item{NULL};
+};
+
+struct CHTable {
+    std::atomic<CHNode *> *slots = NULL;
+    size_t mask = 0;
+};
+
+// the tables readers look in, replaced as a whole
+struct CHState {
+    CHTable *newer = NULL;
+    CHTable *older = NULL; // being moved into newer, NULL when not resizing
+};
+
+const size_t CHM_STRIPES = 64; // power of 2, at most CHM_INIT_SLOTS
+const size_t CHM_INIT_SLOTS = 64;
+
+// old buckets a write moves over during a resize
+const size_t CHM_MIGRATE_BUCKETS = 8;
+
+// max ratio between items and buckets. lower than HashMap's, reads are what
+// this map is for.
+const size_t CHM_MAX_LOAD = 2;
+
+struct CHStripe {
+    alignas(64) std::mutex mu;
+    size_t migrate_pos = 0; // next bucket of the older table to move
+    bool migrated = true; // all of this stripe's old buckets are moved
+};
+
+struct CHMap {
+    std::atomic<CHState *> state{NULL};
+    CHStripe stripes[CHM_STRIPES];
+    std::atomic<size_t> size{0};
+    std::atomic<size_t> stripes_left{0}; // stripes still moving buckets
+    std::atomic<size_t> help_pos{0}; // the stripe the next write helps
+};
+
+void chm_init(CHMap *m);
+
+// frees every node and table and passes each item to free_item. no other
+// thread may be using the map.
+void chm_destroy(CHMap *m, void (*free_item)(void *));
+
+inline size_t chm_size(CHMap *m) {
+    return m->size.load(std::memory_order_relaxed);
+}
+
+// internals used by the templates below
+void chm_push(CHTable *t, CHNode *node);
+void chm_after_write(CHMap *m, size_t stripe);
+void chm_free_node(void *node);
+
+inline size_t chm_stripe(uint64_t hashcode) {
+    return hashcode & (CHM_STRIPES - 1);
+}
+
+template <typename Pred>
+inline void *cht_lookup(CHTable *t, uint64_t hashcode, Pred &pred) {
+    CHNode *node = t->slots[hashcode & t->mask].load(std::memory_order_acquire);
+    for (; node; node = node->next.load(std::memory_order_acquire)) {
+        if (node->hashcode != hashcode) {
+            continue;
+        }
+        void *item = node->item.load(std::memory_order_acquire);
+        if (pred(item)) {
+            return item;
+        }
+    }
+    return NULL;
+}
+
+// the link pointing at the key's node, NULL if missing. the key's stripe
+// must be locked.
+template <typename Pred>
+inline std::atomic<CHNode *> *cht_find(CHTable *t, uint64_t hashcode, Pred &pred) {
+    std::atomic<CHNode *> *link = &t->slots[hashcode & t->mask];
+    CHNode *node = NULL;
+    while ((node = link->load(std::memory_order_relaxed))) {
+        if (node->hashcode == hashcode && pred(node->item.load(std::memory_order_relaxed))) {
+            return link;
+        }
+        link = &node->next;
+    }
+    return NULL;
+}
+
+// pred is called with items whose hashcode matches. must be called inside
+// an epoch section, the item stays valid until the section ends.
+template <typename Pred>
+inline void *chm_lookup(CHMap *m, uint64_t hashcode, Pred &&pred) {
+    while (true) {
+        CHState *st = m->state.load(std::memory_order_acquire);
+        void *item = st->older ? cht_lookup(st->older, hashcode, pred) : NULL;
+        if (!item) {
+            item = cht_lookup(st->newer, hashcode, pred);
+        }
+        if (item || m->state.load(std::memory_order_acquire) == st) {
+            return item;
+        }
+    }
+}
+
+// inserts item, or swaps it in for the item pred matches. returns the item
+// it replaced, which the caller has to retire, or NULL.
+template <typename Pred>
+inline void *chm_put(CHMap *m, uint64_t hashcode, void *item, Pred &&pred) {
+    EpochGuard guard;
+    size_t stripe = chm_stripe(hashcode);
+    void *old = NULL;
+    {
+        std::lock_guard<std::mutex> lock(m->stripes[stripe].mu);
+        // newer only changes with every stripe locked, so this one is stable
+        CHState *st = m->state.load(std::memory_order_acquire);
+        std::atomic<CHNode *> *link = st->older ? cht_find(st->older, hashcode, pred) : NULL;
+        if (!link) {
+            link = cht_find(st->newer, hashcode, pred);
+        }
+        if (link) {
+            old = link->load(std::memory_order_relaxed)->item.exchange(item, std::memory_order_acq_rel);
+        } else {
+            CHNode *node = new CHNode();
+            node->hashcode = hashcode;
+            node->item.store(item, std::memory_order_relaxed);
+            chm_push(st->newer, node);
+            m->size.fetch_add(1, std::memory_order_relaxed);
+        }
+    }
+    chm_after_write(m, stripe);
+    return old;
+}
+
+// unlinks the item pred matches and returns it for the caller to retire,
+// NULL if there is none
+template <typename Pred>
+inline void *chm_remove(CHMap *m, uint64_t hashcode, Pred &&pred) {
+    EpochGuard guard;
+    size_t stripe = chm_stripe(hashcode);
+    void *item = NULL;
+    {
+        std::lock_guard<std::mutex> lock(m->stripes[stripe].mu);
+        CHState *st = m->state.load(std::memory_order_acquire);
+        std::atomic<CHNode *> *link = st->older ? cht_find(st->older, hashcode, pred) : NULL;
+        if (!link) {
+            link = cht_find(st->newer, hashcode, pred);
+        }
+        if (link) {
+            CHNode *node = link->load(std::memory_order_relaxed);
+            // the node keeps its next, readers standing on it carry on
+            link->store(node->next.load(std::memory_order_relaxed), std::memory_order_release);
+            item = node->item.load(std::memory_order_relaxed);
+            epoch_retire(node, &chm_free_node);
+            m->size.fetch_sub(1, std::memory_order_relaxed);
+        }
+    }
+    if (item) {
+        chm_after_write(m, stripe);
+    }
+    return item;
+}
+
+/**
+ * Typed wrapper, like IntrusiveMap but items don't embed a node. Reads have to
+ * happen inside an epoch section and items that come back from put or del
+ * have to be retired, not deleted.
+ */
+template <typename T, typename Hash, typename Eq>
+class ConcurrentHashMap {
+public:
+    ConcurrentHashMap() {
+        chm_init(&m);
+    }
+    ConcurrentHashMap(const ConcurrentHashMap &) = delete;
+    ConcurrentHashMap &operator=(const ConcurrentHashMap &) = delete;
+
+    static uint64_t hash(std::string_view key) {
+        return Hash{}(key);
+    }
+
+    T *get(std::string_view key) {
+        return get(key, hash(key));
+    }
+
+    T *get(std::string_view key, uint64_t hashcode) {
+        return (T *) chm_lookup(&m, hashcode, [key](void *item) {
+            return Eq{}(*(T *)item, key);
+        });
+    }
+
+    // returns the item it replaced
+    T *put(T *item, std::string_view key) {
+        return (T *) chm_put(&m, hash(key), item, [key](void *cur) {
+            return Eq{}(*(T *)cur, key);
+        });
+    }
+
+    T *del(std::string_view key) {
+        return (T *) chm_remove(&m, hash(key), [key](void *item) {
+            return Eq{}(*(T *)item, key);
+        });
+    }
+
+    size_t size() {
+        return chm_size(&m);
+    }
+
+    // deletes the item once no reader can see it anymore
+    static void retire(T *item) {
+        epoch_retire(item, [](void *ptr) { delete (T *)ptr; });
+    }
+
+    void destroy() {
+        chm_destroy(&m, [](void *ptr) { delete (T *)ptr; });
+    }
+
+    CHMap m;
+};
@@ -0,0 +1,47 @@
+#pragma once
+
+#include <stddef.h>
+
+/**
+ * Intrusive circular doubly linked list.
+ *
+ * The list head is a DList of its own that is never an item. A node that
+ * is not in any list points at itself, so detaching it again is harmless.
+ */
+
+struct DList {
+    DList *prev = this;
+    DList *next = this;
+};
+
+inline void dlist_init(DList *node) {
+    node->prev = node->next = node;
+}
+
+inline bool dlist_empty(DList *node) {
+    return node->next == node;
+}
+
+inline void dlist_detach(DList *node) {
+    DList *prev = node->prev;
+    DList *next = node->next;
+    prev->next = next;
+    next->prev = prev;
+    dlist_init(node);
+}
+
+// links rookie right before target, i.e. at the back when target is the head
+inline void dlist_insert_before(DList *target, DList *rookie) {
+    DList *prev = target->prev;
+    prev->next = rookie;
+    rookie->prev = prev;
+    rookie->next = target;
+    target->prev = rookie;
+}
+
+// the item node is embedded in, same trick as IntrusiveMap::from_node
+template <typename T, DList T::*Node>
+T *dlist_item(DList *node) {
+    size_t offset = (size_t)&(((T *)0)->*Node);
+    return (T *)((char *)node - offset);
+}
@@ -0,0 +1,126 @@
+#include <atomic>
+#include <mutex>
+#include <vector>
+#include "epoch.h"
+
+// retires between attempts to move the epoch on and free things
+const size_t EPOCH_SCAN_EVERY = 64;
+
+struct Retired {
+    void *ptr;
+    void (*free_fn)(void *);
+    uint64_t epoch; // the global epoch when it was retired
+};
+
+struct EpochRecord {
+    // the epoch this thread entered in, 0 while outside. on its own cache
+    // line since every reader writes it twice per section.
+    alignas(64) std::atomic<uint64_t> active{0};
+    bool in_use = false; // guarded by registry_mu
+    uint32_t depth = 0; // nested enters
+    size_t since_scan = 0;
+    std::vector<Retired> limbo;
+};
+
+static std::atomic<uint64_t> global_epoch{1};
+static std::mutex registry_mu;
+static std::vector<EpochRecord *> registry;
+
+// gives the record back when the thread exits
+struct EpochSelf {
+    EpochRecord *rec = NULL;
+    ~EpochSelf() {
+        if (rec) {
+            std::lock_guard<std::mutex> lock(registry_mu);
+            rec->in_use = false;
+        }
+    }
+};
+
+static thread_local EpochSelf self;
+
+static EpochRecord *self_record() {
+    if (self.rec) {
+        return self.rec;
+    }
+    std::lock_guard<std::mutex> lock(registry_mu);
+    for (EpochRecord *rec : registry) {
+        if (!rec->in_use) {
+            self.rec = rec;
+            break;
+        }
+    }
+    if (!self.rec) {
+        self.rec = new EpochRecord();
+        registry.push_back(self.rec);
+    }
+    self.rec->in_use = true;
+    return self.rec;
+}
+
+void epoch_enter() {
+    EpochRecord *rec = self_record();
+    if (rec->depth++ > 0) {
+        return;
+    }
+    rec->active.store(global_epoch.load(std::memory_order_relaxed), std::memory_order_relaxed);
+    // the epoch must be visible before we load any shared pointer
+    std::atomic_thread_fence(std::memory_order_seq_cst);
+}
+
+void epoch_exit() {
+    EpochRecord *rec = self.rec;
+    if (--rec->depth == 0) {
+        rec->active.store(0, std::memory_order_release);
+    }
+}
+
+// moves the global epoch on if every thread inside a section has seen it
+static void try_advance() {
+    std::atomic_thread_fence(std::memory_order_seq_cst);
+    uint64_t cur = global_epoch.load(std::memory_order_acquire);
+    {
+        std::lock_guard<std::mutex> lock(registry_mu);
+        for (EpochRecord *rec : registry) {
+            uint64_t active = rec->active.load(std::memory_order_acquire);
+            if (active && active != cur) {
+                return;
+            }
+        }
+    }
+    global_epoch.compare_exchange_strong(cur, cur + 1);
+}
+
+static void reclaim(EpochRecord *rec) {
+    uint64_t cur = global_epoch.load(std::memory_order_acquire);
+    size_t kept = 0;
+    for (Retired &r : rec->limbo) {
+        if (r.epoch + 2 <= cur) {
+            r.free_fn(r.ptr);
+        } else {
+            rec->limbo[kept++] = r;
+        }
+    }
+    rec->limbo.resize(kept);
+    rec->since_scan = 0;
+}
+
+void epoch_retire(void *ptr, void (*free_fn)(void *)) {
+    EpochRecord *rec = self_record();
+    // the unlink that made ptr unreachable has to be visible before we read
+    // the epoch. otherwise a reader could enter in a newer epoch, still find
+    // ptr, and have it freed under it once that epoch is 2 behind.
+    std::atomic_thread_fence(std::memory_order_seq_cst);
+    rec->limbo.push_back({ptr, free_fn, global_epoch.load(std::memory_order_acquire)});
+    if (++rec->since_scan >= EPOCH_SCAN_EVERY) {
+        try_advance();
+        reclaim(rec);
+    }
+}
+
+void epoch_reclaim() {
+    EpochRecord *rec = self_record();
+    try_advance();
+    try_advance();
+    reclaim(rec);
+}
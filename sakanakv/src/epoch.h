@@ -0,0 +1,39 @@
+#pragma once
+
+#include <stddef.h>
+#include <stdint.h>
+
+/**
+ * Epoch based memory reclamation for lock-free readers.
+ *
+ * Readers wrap every access to shared nodes in epoch_enter/epoch_exit (or
+ * an EpochGuard), which costs them one store each way and no locks.
+ * Writers that unlink something readers may still be looking at hand it
+ * to epoch_retire instead of freeing it. There is a global epoch and each
+ * thread publishes the one it entered in. The global epoch only moves on
+ * once every thread inside a section has seen the current one, so once it
+ * has moved twice past the epoch something was retired in, nobody can
+ * still hold a pointer to it and it gets freed.
+ *
+ * Threads register themselves on first use. A thread that exits hands its
+ * record, and whatever it retired that isn't freed yet, to the next new
+ * thread.
+ */
+
+void epoch_enter();
+void epoch_exit();
+
+// frees ptr with free_fn once no reader can see it anymore. must be called
+// after ptr was unlinked from everything readers can reach.
+void epoch_retire(void *ptr, void (*free_fn)(void *));
+
+// frees what this thread retired as far as the epoch allows, used by
+// threads that retire a lot in a burst and then stop
+void epoch_reclaim();
+
+struct EpochGuard {
+    EpochGuard() { epoch_enter(); }
+    ~EpochGuard() { epoch_exit(); }
+    EpochGuard(const EpochGuard &) = delete;
+    EpochGuard &operator=(const EpochGuard &) = delete;
+};
@@ -1,8 +1,18 @@
+#pragma once
+
 #include <stddef.h>
 #include <stdint.h>
+#include <stdlib.h>
+#include <string_view>
 
 /**
  * Implementation of a hashmap with chained collision resolution.
+ *
+ * The core (HashMap) is untyped and works on intrusive HashTableNodes. The
+ * IntrusiveMap template wraps it for a concrete entry type so that the hash
+ * and key comparison are known at compile time and get inlined into the
+ * chain walk. The C-style hm_* functions on HashMap are kept as thin
+ * wrappers.
  */
 
 // A single node in the hashmap
@@ -25,6 +35,169 @@ struct HashMap {
     size_t resizing_pos = 0;
 };
 
+const size_t RESIZE_BATCH_SIZE = 128;
+
+// max ratio between hashtable size and num of buckets
+const size_t RESIZE_THRESHOLD = 8;
+
+// initialise a fixed size hashtable
+inline void ht_init(HashTable *ht, size_t n) {
+    ht->table = (HashTableNode **)calloc(sizeof(HashTableNode *), n);
+    ht->mask = n - 1;
+    ht->size = 0;
+}
+
+// insert into said hashtable
+inline void ht_insert(HashTable *ht, HashTableNode *node) {
+    // group based on the prefix
+    size_t position = node->hashcode & ht->mask;
+
+    // append to the front
+    HashTableNode *next = ht->table[position];
+    node->next = next;
+    ht->table[position] = node;
+    ht->size++;
+}
+
+// hashtable lookup. pred is called with every node in the chain whose
+// hashcode matches, so it only has to compare the keys.
+template <typename Pred>
+inline HashTableNode **ht_lookup(HashTable *ht, uint64_t hashcode, Pred &&pred) {
+    if (!ht->table) {
+        return NULL;
+    }
+
+    size_t position = hashcode & ht->mask;
+
+    // set ptr to the head of the appropriate chain
+    HashTableNode **ptr = &ht->table[position];
+
+    // iterate through the linked list and return the ptr to the ptr to the
+    // node we need
+    while (*ptr) {
+        if ((*ptr)->hashcode == hashcode && pred(*ptr)) {
+            return ptr;
+        }
+        ptr = &(*ptr)->next;
+    }
+    return NULL;
+}
+
+inline HashTableNode *ht_pop(HashTable *ht, HashTableNode **node) {
+    HashTableNode *removed = *node;
+    *node = (*node)->next;
+    ht->size--;
+    return removed;
+}
+
+// move 1 batch from ht2 to ht1
+inline void hm_move_batch(HashMap *hm) {
+    if (hm->ht2.table == NULL) {
+        return; // can't move anything if h2 is null
+    }
+
+    size_t moved_cnt = 0;
+    while (moved_cnt < RESIZE_BATCH_SIZE && hm->ht2.size > 0) {
+        HashTableNode **start = &hm->ht2.table[hm->resizing_pos];
+        if (!*start) {
+            // this bucket is empty, move on to the next one
+            hm->resizing_pos++;
+            continue;
+        }
+
+        // move the node
+        ht_insert(&hm->ht1, ht_pop(&hm->ht2, start));
+        moved_cnt++;
+    }
+
+    if (hm->ht2.size == 0) {
+        // if there are no more records to move, free ht2's table
+        free(hm->ht2.table);
+        hm->ht2 = HashTable{};
+    }
+}
+
+inline void hm_resize(HashMap *hm) {
+    // swap ht1 to ht2 for the batches to get moved
+    hm->ht2 = hm->ht1;
+
+    // double ht1 size
+    ht_init(&hm->ht1, (hm->ht1.mask + 1) * 2);
+
+    // reset the resizing_pos index
+    hm->resizing_pos = 0;
+}
+
+template <typename Pred>
+inline HashTableNode *hm_lookup(HashMap *hm, uint64_t hashcode, Pred &&pred) {
+    // trigger batch move
+    hm_move_batch(hm);
+
+    // get it from either ht1 or ht2
+    HashTableNode **node = ht_lookup(&hm->ht1, hashcode, pred);
+    if (!node) {
+        node = ht_lookup(&hm->ht2, hashcode, pred);
+    }
+
+    // return node if exists else NULL
+    return node ? *node : NULL;
+}
+
+template <typename Pred>
+inline HashTableNode *hm_remove(HashMap *hm, uint64_t hashcode, Pred &&pred) {
+    hm_move_batch(hm);
+    HashTableNode **node = ht_lookup(&hm->ht1, hashcode, pred);
+    if (node) {
+        return ht_pop(&hm->ht1, node);
+    }
+    node = ht_lookup(&hm->ht2, hashcode, pred);
+    if (node) {
+        return ht_pop(&hm->ht2, node);
+    }
+    return NULL;
+}
+
+inline void hm_insert(HashMap *hm, HashTableNode *node) {
+    if (!hm->ht1.table) {
+        ht_init(&hm->ht1, 4);
+    }
+    ht_insert(&hm->ht1, node);
+    if (!hm->ht2.table) {
+        size_t load_factor = hm->ht1.size / (hm->ht1.mask + 1);
+        if (load_factor >= RESIZE_THRESHOLD) {
+            hm_resize(hm);
+        }
+    }
+    hm_move_batch(hm);
+}
+
+// bytes taken by the bucket arrays of both tables
+inline size_t hm_bucket_bytes(const HashMap *hm) {
+    size_t buckets = 0;
+    buckets += hm->ht1.table ? hm->ht1.mask + 1 : 0;
+    buckets += hm->ht2.table ? hm->ht2.mask + 1 : 0;
+    return buckets * sizeof(HashTableNode *);
+}
+
+// applies funct to each node in a given hashtable
+template <typename F>
+inline void ht_foreach(HashTable *ht, F &&funct) {
+    if (ht->size == 0) {
+        return;
+    }
+
+    for (size_t i = 0; i < ht->mask + 1; ++i) {
+        HashTableNode *node = ht->table[i];
+        while (node) {
+            // grab next first so funct is allowed to free the node
+            HashTableNode *next = node->next;
+            funct(node);
+            node = next;
+        }
+    }
+}
+
+// C-style API, kept for callers that compare through a function pointer
 HashTableNode *hm_get(
     HashMap *hm,
     HashTableNode *key,
@@ -43,3 +216,92 @@ void hm_destroy(HashMap *hm);
 
 size_t hm_size(HashMap *hm);
 
+// FNV style hash used for all keys
+inline uint64_t hash_string(const uint8_t *data, size_t len) {
+    uint32_t hash = 0x811C9DC5;
+    for (size_t i = 0; i < len; i++) {
+        hash = (hash + data[i]) * 0x01000193;
+    }
+    return hash;
+}
+
+struct StringViewHash {
+    uint64_t operator()(std::string_view key) const {
+        return hash_string((const uint8_t *)key.data(), key.size());
+    }
+};
+
+/**
+ * Typed intrusive hashmap.
+ *
+ * T embeds a HashTableNode at member Node. Hash maps a std::string_view key
+ * to its hashcode and Eq compares a T against a std::string_view, so lookups
+ * never need a temporary T to be built.
+ */
+template <typename T, HashTableNode T::*Node, typename Hash, typename Eq>
+class IntrusiveMap {
+public:
+    IntrusiveMap() = default;
+    IntrusiveMap(const IntrusiveMap &) = delete;
+    IntrusiveMap &operator=(const IntrusiveMap &) = delete;
+
+    static T *from_node(HashTableNode *node) {
+        // same trick as container_of, but for a pointer to member
+        size_t offset = (size_t)&(((T *)0)->*Node);
+        return (T *)((char *)node - offset);
+    }
+
+    static uint64_t hash(std::string_view key) {
+        return Hash{}(key);
+    }
+
+    T *get(std::string_view key) {
+        return get(key, hash(key));
+    }
+
+    T *get(std::string_view key, uint64_t hashcode) {
+        HashTableNode *node = hm_lookup(&hm, hashcode, [key](HashTableNode *n) {
+            return Eq{}(*from_node(n), key);
+        });
+        return node ? from_node(node) : NULL;
+    }
+
+    // insert item under key. the caller must make sure key is not present.
+    void put(T *item, std::string_view key) {
+        put(item, hash(key));
+    }
+
+    void put(T *item, uint64_t hashcode) {
+        (item->*Node).hashcode = hashcode;
+        hm_insert(&hm, &(item->*Node));
+    }
+
+    // unlink and return the item stored under key, NULL if there is none
+    T *del(std::string_view key) {
+        uint64_t hashcode = hash(key);
+        HashTableNode *node = hm_remove(&hm, hashcode, [key](HashTableNode *n) {
+            return Eq{}(*from_node(n), key);
+        });
+        return node ? from_node(node) : NULL;
+    }
+
+    template <typename F>
+    void foreach(F &&funct) {
+        auto visit = [&funct](HashTableNode *n) { funct(from_node(n)); };
+        ht_foreach(&hm.ht1, visit);
+        ht_foreach(&hm.ht2, visit);
+    }
+
+    size_t size() const {
+        return hm.ht1.size + hm.ht2.size;
+    }
+
+    // frees the bucket arrays only, the items belong to the caller
+    void destroy() {
+        free(hm.ht1.table);
+        free(hm.ht2.table);
+        hm = HashMap{};
+    }
+
+    HashMap hm;
+};
@@ -0,0 +1,166 @@
+#include "hashobj.h"
+#include "memusage.h"
+
+static void packed_append(std::string &packed, std::string_view str) {
+    uint32_t len = (uint32_t) str.size();
+    packed.append((char *)&len, 4);
+    packed.append(str.data(), str.size());
+}
+
+// finds the start of the pair with the given field, -1 if it is missing
+static int64_t packed_find(const std::string &packed, std::string_view field) {
+    size_t pos = 0;
+    while (pos < packed.size()) {
+        size_t start = pos;
+        std::string_view cur = hobj_packed_read(packed, pos);
+        if (cur == field) {
+            return (int64_t) start;
+        }
+
+        hobj_packed_read(packed, pos); // skip the value
+    }
+    return -1;
+}
+
+static void hobj_insert_field(HashObj *h, std::string_view field, std::string_view value) {
+    HashField *hf = new HashField();
+    hf->field.assign(field.data(), field.size());
+    hf->value.assign(value.data(), value.size());
+    h->map.put(hf, field);
+}
+
+// move every packed pair into the nested map
+static void hobj_convert(HashObj *h) {
+    size_t pos = 0;
+    while (pos < h->packed.size()) {
+        std::string_view field = hobj_packed_read(h->packed, pos);
+        std::string_view value = hobj_packed_read(h->packed, pos);
+        hobj_insert_field(h, field, value);
+    }
+    std::string().swap(h->packed);
+    h->encoding = HOBJ_MAP;
+}
+
+bool hobj_set(
+        HashObj *h,
+        std::string_view field,
+        std::string_view value,
+        const HashObjLimits &limits
+    ) {
+    if (h->encoding == HOBJ_PACKED) {
+        int64_t start = packed_find(h->packed, field);
+        bool fits = field.size() <= limits.max_packed_value
+            && value.size() <= limits.max_packed_value
+            && (start >= 0 || h->len + 1 <= limits.max_packed_entries);
+
+        if (fits && start >= 0) {
+            // overwrite the old value in place
+            size_t pos = (size_t) start + 4 + field.size();
+            uint32_t old_len = 0;
+            memcpy(&old_len, &h->packed[pos], 4);
+            uint32_t new_len = (uint32_t) value.size();
+            memcpy(&h->packed[pos], &new_len, 4);
+            h->packed.replace(pos + 4, old_len, value.data(), value.size());
+            return false;
+        }
+        if (fits) {
+            packed_append(h->packed, field);
+            packed_append(h->packed, value);
+            h->len++;
+            return true;
+        }
+        hobj_convert(h);
+    }
+
+    HashField *hf = h->map.get(field);
+    if (hf) {
+        hf->value.assign(value.data(), value.size());
+        return false;
+    }
+    hobj_insert_field(h, field, value);
+    h->len++;
+    return true;
+}
+
+bool hobj_get(HashObj *h, std::string_view field, std::string_view *val) {
+    if (h->encoding == HOBJ_MAP) {
+        HashField *hf = h->map.get(field);
+        if (!hf) {
+            return false;
+        }
+        *val = hf->value;
+        return true;
+    }
+
+    int64_t start = packed_find(h->packed, field);
+    if (start < 0) {
+        return false;
+    }
+    size_t pos = (size_t) start + 4 + field.size();
+    *val = hobj_packed_read(h->packed, pos);
+    return true;
+}
+
+bool hobj_del(HashObj *h, std::string_view field) {
+    if (h->encoding == HOBJ_MAP) {
+        HashField *hf = h->map.del(field);
+        if (!hf) {
+            return false;
+        }
+        delete hf;
+        h->len--;
+        return true;
+    }
+
+    int64_t start = packed_find(h->packed, field);
+    if (start < 0) {
+        return false;
+    }
+    size_t end = (size_t) start;
+    hobj_packed_read(h->packed, end); // field
+    hobj_packed_read(h->packed, end); // value
+    h->packed.erase((size_t) start, end - (size_t) start);
+    h->len--;
+    return true;
+}
+
+size_t hobj_len(HashObj *h) {
+    return h->len;
+}
+
+size_t hobj_mem_usage(HashObj *h, size_t samples) {
+    size_t bytes = sizeof(HashObj) + string_heap_bytes(h->packed);
+    if (h->encoding != HOBJ_MAP) {
+        return bytes;
+    }
+    bytes += hm_bucket_bytes(&h->map.hm);
+
+    size_t seen = 0;
+    size_t field_bytes = 0;
+    for (HashTable *ht : {&h->map.hm.ht1, &h->map.hm.ht2}) {
+        for (size_t i = 0; ht->table && i <= ht->mask; i++) {
+            HashTableNode *node = ht->table[i];
+            for (; node && (!samples || seen < samples); node = node->next) {
+                HashField *hf = HashFieldMap::from_node(node);
+                field_bytes += sizeof(HashField)
+                    + string_heap_bytes(hf->field)
+                    + string_heap_bytes(hf->value);
+                seen++;
+            }
+        }
+    }
+    if (seen) {
+        bytes += field_bytes * h->map.size() / seen;
+    }
+    return bytes;
+}
+
+void hobj_destroy(HashObj *h) {
+    if (h->encoding == HOBJ_MAP) {
+        h->map.foreach([](HashField *hf) { delete hf; });
+        h->map.destroy();
+    }
+    std::string().swap(h->packed);
+    h->encoding = HOBJ_PACKED;
+    h->len = 0;
+}
@@ -0,0 +1,100 @@
+#pragma once
+
+#include <stddef.h>
+#include <stdint.h>
+#include <string.h>
+#include <string>
+#include <string_view>
+#include "hashmap.h"
+
+/**
+ * Hash value type (a field -> value map stored under one key).
+ *
+ * Small hashes are kept packed: all pairs live back to back in one buffer as
+ * [u32 field len][field][u32 value len][value] and lookups scan it linearly.
+ * Once a hash outgrows the configured limits it is converted to a nested
+ * IntrusiveMap and stays that way.
+ */
+
+enum {
+    HOBJ_PACKED = 0,
+    HOBJ_MAP = 1
+};
+
+// a single field once the hash has been converted to a map
+struct HashField {
+    HashTableNode node;
+    std::string field;
+    std::string value;
+};
+
+struct HashFieldEq {
+    bool operator()(const HashField &hf, std::string_view field) const {
+        return hf.field == field;
+    }
+};
+
+typedef IntrusiveMap<HashField, &HashField::node, StringViewHash, HashFieldEq> HashFieldMap;
+
+// limits above which a packed hash gets converted to a map
+struct HashObjLimits {
+    size_t max_packed_entries = 64;
+    size_t max_packed_value = 64; // applies to both fields and values
+};
+
+struct HashObj {
+    uint32_t encoding = HOBJ_PACKED;
+    uint32_t len = 0; // number of fields
+    std::string packed;
+    HashFieldMap map;
+};
+
+// returns true if field was newly added, false if an old value was replaced
+bool hobj_set(
+    HashObj *h,
+    std::string_view field,
+    std::string_view value,
+    const HashObjLimits &limits
+);
+
+// points val at the stored value, only valid until the hash is modified
+bool hobj_get(HashObj *h, std::string_view field, std::string_view *val);
+
+bool hobj_del(HashObj *h, std::string_view field);
+
+size_t hobj_len(HashObj *h);
+
+// bytes used by the hash, the HashObj itself included. a map with more
+// than samples fields is estimated from the first samples of them, 0
+// measures every field.
+size_t hobj_mem_usage(HashObj *h, size_t samples);
+
+// frees everything owned by the hash, but not the HashObj itself
+void hobj_destroy(HashObj *h);
+
+// reads one length prefixed string from the packed buffer at pos
+inline std::string_view hobj_packed_read(const std::string &packed, size_t &pos) {
+    uint32_t len = 0;
+    memcpy(&len, &packed[pos], 4);
+    std::string_view str(&packed[pos + 4], len);
+    pos += 4 + len;
+    return str;
+}
+
+// calls funct(field, value) for every pair in the hash
+template <typename F>
+inline void hobj_foreach(HashObj *h, F &&funct) {
+    if (h->encoding == HOBJ_MAP) {
+        h->map.foreach([&funct](HashField *hf) {
+            funct(std::string_view(hf->field), std::string_view(hf->value));
+        });
+        return;
+    }
+
+    size_t pos = 0;
+    while (pos < h->packed.size()) {
+        std::string_view field = hobj_packed_read(h->packed, pos);
+        std::string_view value = hobj_packed_read(h->packed, pos);
+        funct(field, value);
+    }
+}
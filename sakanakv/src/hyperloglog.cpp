@@ -0,0 +1,244 @@
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+#include <algorithm>
+#include "hyperloglog.h"
+
+#if defined(__SSE2__)
+#include <emmintrin.h>
+#endif
+
+// MurmurHash64A, the 32 bit key hash is too narrow for a 2^14 register HLL
+static uint64_t hash64(const uint8_t *data, size_t len) {
+    const uint64_t m = 0xc6a4a7935bd1e995ULL;
+    const int r = 47;
+    uint64_t h = 0xadc83b19ULL ^ (len * m);
+
+    size_t blocks = len / 8;
+    for (size_t i = 0; i < blocks; i++) {
+        uint64_t k;
+        memcpy(&k, &data[i * 8], 8);
+        k *= m;
+        k ^= k >> r;
+        k *= m;
+        h ^= k;
+        h *= m;
+    }
+
+    const uint8_t *tail = &data[blocks * 8];
+    switch (len & 7) {
+        case 7: h ^= (uint64_t)tail[6] << 48; // fallthrough
+        case 6: h ^= (uint64_t)tail[5] << 40; // fallthrough
+        case 5: h ^= (uint64_t)tail[4] << 32; // fallthrough
+        case 4: h ^= (uint64_t)tail[3] << 24; // fallthrough
+        case 3: h ^= (uint64_t)tail[2] << 16; // fallthrough
+        case 2: h ^= (uint64_t)tail[1] << 8; // fallthrough
+        case 1: h ^= (uint64_t)tail[0];
+                h *= m;
+    }
+
+    h ^= h >> r;
+    h *= m;
+    h ^= h >> r;
+    return h;
+}
+
+// register i lives at bit i * 6 of the dense buffer
+static uint8_t dense_get(const uint8_t *dense, uint32_t i) {
+    size_t bit = (size_t) i * HLL_BITS;
+    uint32_t word = dense[bit / 8] | (dense[bit / 8 + 1] << 8);
+    return (word >> (bit & 7)) & 63;
+}
+
+static void dense_set(uint8_t *dense, uint32_t i, uint8_t val) {
+    size_t bit = (size_t) i * HLL_BITS;
+    uint32_t word = dense[bit / 8] | (dense[bit / 8 + 1] << 8);
+    word &= ~(63u << (bit & 7));
+    word |= (uint32_t) val << (bit & 7);
+    dense[bit / 8] = (uint8_t) word;
+    dense[bit / 8 + 1] = (uint8_t)(word >> 8);
+}
+
+// every 3 bytes hold 4 registers
+static void dense_unpack(const uint8_t *dense, uint8_t *regs) {
+    for (uint32_t i = 0, b = 0; i < HLL_REGISTERS; i += 4, b += 3) {
+        uint8_t b0 = dense[b];
+        uint8_t b1 = dense[b + 1];
+        uint8_t b2 = dense[b + 2];
+        regs[i] = b0 & 63;
+        regs[i + 1] = ((b0 >> 6) | (b1 << 2)) & 63;
+        regs[i + 2] = ((b1 >> 4) | (b2 << 4)) & 63;
+        regs[i + 3] = b2 >> 2;
+    }
+}
+
+static void dense_pack(const uint8_t *regs, uint8_t *dense) {
+    for (uint32_t i = 0, b = 0; i < HLL_REGISTERS; i += 4, b += 3) {
+        dense[b] = regs[i] | (regs[i + 1] << 6);
+        dense[b + 1] = (regs[i + 1] >> 2) | (regs[i + 2] << 4);
+        dense[b + 2] = (regs[i + 2] >> 4) | (regs[i + 3] << 2);
+    }
+    dense[HLL_DENSE_BYTES] = 0;
+}
+
+static void hll_to_dense(HyperLogLog *hll) {
+    hll->dense = (uint8_t *)calloc(HLL_DENSE_BYTES + 1, 1);
+    for (uint32_t word : hll->sparse) {
+        dense_set(hll->dense, word >> 8, word & 0xff);
+    }
+    std::vector<uint32_t>().swap(hll->sparse);
+    hll->encoding = HLL_DENSE;
+}
+
+bool hll_add(HyperLogLog *hll, std::string_view elem) {
+    uint64_t hash = hash64((const uint8_t *)elem.data(), elem.size());
+    uint32_t index = hash & (HLL_REGISTERS - 1);
+    // position of the first set bit in the rest of the hash, capped so
+    // it always fits in 6 bits
+    uint64_t rest = (hash >> HLL_P) | (1ULL << (64 - HLL_P));
+    uint8_t rank = (uint8_t) __builtin_ctzll(rest) + 1;
+
+    if (hll->encoding == HLL_DENSE) {
+        if (dense_get(hll->dense, index) >= rank) {
+            return false;
+        }
+        dense_set(hll->dense, index, rank);
+        return true;
+    }
+
+    std::vector<uint32_t> &sparse = hll->sparse;
+    auto it = std::lower_bound(sparse.begin(), sparse.end(), index << 8);
+    if (it != sparse.end() && (*it >> 8) == index) {
+        if ((*it & 0xff) >= rank) {
+            return false;
+        }
+        *it = (index << 8) | rank;
+        return true;
+    }
+    sparse.insert(it, (index << 8) | rank);
+    if (sparse.size() > HLL_SPARSE_MAX) {
+        hll_to_dense(hll);
+    }
+    return true;
+}
+
+void hll_unpack(HyperLogLog *hll, HllRegisters *out) {
+    if (hll->encoding == HLL_DENSE) {
+        dense_unpack(hll->dense, out->regs);
+        return;
+    }
+    memset(out->regs, 0, sizeof(out->regs));
+    for (uint32_t word : hll->sparse) {
+        out->regs[word >> 8] = word & 0xff;
+    }
+}
+
+void hll_merge_into(HllRegisters *out, HyperLogLog *hll) {
+    if (hll->encoding == HLL_SPARSE) {
+        for (uint32_t word : hll->sparse) {
+            uint8_t &reg = out->regs[word >> 8];
+            reg = std::max(reg, (uint8_t)(word & 0xff));
+        }
+        return;
+    }
+
+    HllRegisters other;
+    dense_unpack(hll->dense, other.regs);
+#if defined(__SSE2__)
+    for (uint32_t i = 0; i < HLL_REGISTERS; i += 16) {
+        __m128i a = _mm_load_si128((const __m128i *)&out->regs[i]);
+        __m128i b = _mm_load_si128((const __m128i *)&other.regs[i]);
+        _mm_store_si128((__m128i *)&out->regs[i], _mm_max_epu8(a, b));
+    }
+#else
+    for (uint32_t i = 0; i < HLL_REGISTERS; i++) {
+        out->regs[i] = std::max(out->regs[i], other.regs[i]);
+    }
+#endif
+}
+
+uint64_t hll_estimate(const HllRegisters *regs) {
+    // sum of 2^-reg over all registers, plus the number of empty ones
+    double sum = 0;
+    uint32_t zeros = 0;
+#if defined(__SSE2__)
+    const __m128i zero = _mm_setzero_si128();
+    const __m128i bias = _mm_set1_epi32(127);
+    __m128 acc = _mm_setzero_ps();
+    for (uint32_t i = 0; i < HLL_REGISTERS; i += 16) {
+        __m128i v = _mm_load_si128((const __m128i *)&regs->regs[i]);
+        zeros += __builtin_popcount(_mm_movemask_epi8(_mm_cmpeq_epi8(v, zero)));
+
+        // widen to 4 x 4 lanes of u32, then build the float 2^-reg
+        // directly from its exponent bits
+        __m128i lo = _mm_unpacklo_epi8(v, zero);
+        __m128i hi = _mm_unpackhi_epi8(v, zero);
+        __m128i parts[4] = {
+            _mm_unpacklo_epi16(lo, zero), _mm_unpackhi_epi16(lo, zero),
+            _mm_unpacklo_epi16(hi, zero), _mm_unpackhi_epi16(hi, zero),
+        };
+        for (__m128i part : parts) {
+            __m128i bits = _mm_slli_epi32(_mm_sub_epi32(bias, part), 23);
+            acc = _mm_add_ps(acc, _mm_castsi128_ps(bits));
+        }
+    }
+    alignas(16) float lanes[4];
+    _mm_store_ps(lanes, acc);
+    sum = (double)lanes[0] + lanes[1] + lanes[2] + lanes[3];
+#else
+    for (uint32_t i = 0; i < HLL_REGISTERS; i++) {
+        sum += ldexp(1.0, -(int)regs->regs[i]);
+        zeros += regs->regs[i] == 0;
+    }
+#endif
+
+    const double m = HLL_REGISTERS;
+    const double alpha = 0.7213 / (1 + 1.079 / m);
+    double estimate = alpha * m * m / sum;
+    if (estimate <= 2.5 * m && zeros > 0) {
+        // small range correction: linear counting
+        estimate = m * log(m / zeros);
+    }
+    return (uint64_t) llround(estimate);
+}
+
+uint64_t hll_count(HyperLogLog *hll) {
+    HllRegisters regs;
+    hll_unpack(hll, &regs);
+    return hll_estimate(&regs);
+}
+
+void hll_store(HyperLogLog *hll, const HllRegisters *regs) {
+    size_t nonzero = 0;
+    for (uint32_t i = 0; i < HLL_REGISTERS; i++) {
+        nonzero += regs->regs[i] != 0;
+    }
+
+    hll_destroy(hll);
+    if (nonzero > HLL_SPARSE_MAX) {
+        hll->dense = (uint8_t *)malloc(HLL_DENSE_BYTES + 1);
+        dense_pack(regs->regs, hll->dense);
+        hll->encoding = HLL_DENSE;
+        return;
+    }
+
+    hll->sparse.reserve(nonzero);
+    for (uint32_t i = 0; i < HLL_REGISTERS; i++) {
+        if (regs->regs[i]) {
+            hll->sparse.push_back((i << 8) | regs->regs[i]);
+        }
+    }
+}
+
+size_t hll_mem_usage(HyperLogLog *hll) {
+    return sizeof(HyperLogLog)
+        + hll->sparse.capacity() * sizeof(uint32_t)
+        + (hll->dense ? HLL_DENSE_BYTES + 1 : 0);
+}
+
+void hll_destroy(HyperLogLog *hll) {
+    free(hll->dense);
+    hll->dense = NULL;
+    std::vector<uint32_t>().swap(hll->sparse);
+    hll->encoding = HLL_SPARSE;
+}
@@ -0,0 +1,63 @@
+#pragma once
+
+#include <stddef.h>
+#include <stdint.h>
+#include <string_view>
+#include <vector>
+
+/**
+ * HyperLogLog cardinality estimator with 2^14 six bit registers.
+ *
+ * A fresh HLL is sparse: it only stores the registers that are non zero, as
+ * a sorted array of (index << 8 | value) words. Once that array passes
+ * HLL_SPARSE_MAX entries it is converted to the dense form, 16384 registers
+ * packed 6 bits each into ~12 KB.
+ *
+ * Counting and merging unpack the registers into one byte each and work on
+ * 16 registers at a time with SSE2 (with a scalar fallback elsewhere).
+ */
+
+const uint32_t HLL_P = 14;
+const uint32_t HLL_REGISTERS = 1 << HLL_P;
+const uint32_t HLL_BITS = 6;
+const size_t HLL_DENSE_BYTES = HLL_REGISTERS * HLL_BITS / 8;
+
+// sparse entries above which the HLL goes dense (4 bytes each)
+const size_t HLL_SPARSE_MAX = 1024;
+
+enum {
+    HLL_SPARSE = 0,
+    HLL_DENSE = 1
+};
+
+struct HyperLogLog {
+    uint32_t encoding = HLL_SPARSE;
+    std::vector<uint32_t> sparse;
+    uint8_t *dense = NULL; // HLL_DENSE_BYTES + 1 byte of padding
+};
+
+// returns true if a register changed
+bool hll_add(HyperLogLog *hll, std::string_view elem);
+
+uint64_t hll_count(HyperLogLog *hll);
+
+// registers unpacked to one byte each, used to count or merge many HLLs
+struct HllRegisters {
+    alignas(16) uint8_t regs[HLL_REGISTERS];
+};
+
+void hll_unpack(HyperLogLog *hll, HllRegisters *out);
+
+// out = max(out, hll) register by register
+void hll_merge_into(HllRegisters *out, HyperLogLog *hll);
+
+uint64_t hll_estimate(const HllRegisters *regs);
+
+// replaces the contents of hll with the given registers
+void hll_store(HyperLogLog *hll, const HllRegisters *regs);
+
+// frees the registers, but not the HyperLogLog itself
+void hll_destroy(HyperLogLog *hll);
+
+// bytes used by the HLL, the HyperLogLog itself included
+size_t hll_mem_usage(HyperLogLog *hll);
@@ -0,0 +1,126 @@
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include "iopool.h"
+
+static int32_t pread_all(int fd, char *buf, size_t len, uint64_t offset) {
+    while (len > 0) {
+        ssize_t res = pread(fd, buf, len, (off_t) offset);
+        if (res < 0 && errno == EINTR) {
+            continue;
+        }
+        if (res < 0) {
+            return errno;
+        }
+        if (res == 0) {
+            return EIO; // the file is shorter than we were told
+        }
+        buf += res;
+        len -= (size_t) res;
+        offset += (uint64_t) res;
+    }
+    return 0;
+}
+
+static int32_t pwrite_all(int fd, const char *buf, size_t len, uint64_t offset) {
+    while (len > 0) {
+        ssize_t res = pwrite(fd, buf, len, (off_t) offset);
+        if (res < 0 && errno == EINTR) {
+            continue;
+        }
+        if (res < 0) {
+            return errno;
+        }
+        buf += res;
+        len -= (size_t) res;
+        offset += (uint64_t) res;
+    }
+    return 0;
+}
+
+static void run_task(IoTask *task) {
+    switch (task->op) {
+    case IO_READ:
+        task->buf.resize(task->len);
+        task->err = pread_all(task->fd, &task->buf[0], task->len, task->offset);
+        break;
+    case IO_WRITE:
+        task->err = pwrite_all(task->fd, task->buf.data(), task->buf.size(), task->offset);
+        break;
+    case IO_COPY:
+        task->buf.resize(task->len);
+        task->err = pread_all(task->fd, &task->buf[0], task->len, task->offset);
+        if (!task->err) {
+            task->err = pwrite_all(task->dst_fd, task->buf.data(), task->len, task->dst_offset);
+        }
+        std::string().swap(task->buf);
+        break;
+    }
+}
+
+static void worker(IoPool *pool) {
+    while (true) {
+        IoTask *task = NULL;
+        {
+            std::unique_lock<std::mutex> lock(pool->mu);
+            pool->cv.wait(lock, [pool] { return !pool->todo.empty(); });
+            task = pool->todo.front();
+            pool->todo.pop_front();
+        }
+
+        run_task(task);
+
+        bool was_empty = false;
+        {
+            std::lock_guard<std::mutex> lock(pool->mu);
+            was_empty = pool->done.empty();
+            pool->done.push_back(task);
+        }
+        if (was_empty) {
+            // one byte per batch is enough, the loop takes the whole queue.
+            // a full pipe already means a wake up is pending.
+            char c = 0;
+            ssize_t res = 0;
+            do {
+                res = write(pool->wake_fds[1], &c, 1);
+            } while (res < 0 && errno == EINTR);
+        }
+    }
+}
+
+int32_t iopool_start(IoPool *pool, size_t nthreads) {
+    if (pipe(pool->wake_fds)) {
+        return -1;
+    }
+    for (int fd : pool->wake_fds) {
+        fcntl(fd, F_SETFL, fcntl(fd, F_GETFL, 0) | O_NONBLOCK);
+        fcntl(fd, F_SETFD, FD_CLOEXEC);
+    }
+    for (size_t i = 0; i < nthreads; i++) {
+        pool->threads.emplace_back(worker, pool);
+    }
+    return 0;
+}
+
+void iopool_submit(IoPool *pool, IoTask *task) {
+    {
+        std::lock_guard<std::mutex> lock(pool->mu);
+        pool->todo.push_back(task);
+    }
+    pool->cv.notify_one();
+    pool->inflight++;
+}
+
+void iopool_take_done(IoPool *pool, std::vector<IoTask *> *out) {
+    // drain the pipe first, a task finishing after this writes a fresh byte
+    char buf[64];
+    while (read(pool->wake_fds[0], buf, sizeof(buf)) > 0) {}
+
+    size_t start = out->size();
+    {
+        std::lock_guard<std::mutex> lock(pool->mu);
+        out->insert(out->end(), pool->done.begin(), pool->done.end());
+        pool->done.clear();
+    }
+    pool->inflight -= out->size() - start;
+}
@@ -0,0 +1,61 @@
+#pragma once
+
+#include <stddef.h>
+#include <stdint.h>
+#include <condition_variable>
+#include <deque>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+/**
+ * Small pool of threads doing blocking file I/O for the event loop.
+ *
+ * The loop submits tasks and goes back to poll(). Finished tasks are queued
+ * and a byte is written to a pipe, whose read end the loop polls next to
+ * its sockets; it then takes the finished tasks and acts on the results.
+ * The pool never touches anything but the task itself.
+ */
+
+enum {
+    IO_READ = 0, // len bytes at fd:offset into buf
+    IO_WRITE = 1, // buf to fd:offset
+    IO_COPY = 2 // len bytes at fd:offset to dst_fd:dst_offset
+};
+
+struct IoTask {
+    uint32_t op = IO_READ;
+    int fd = -1;
+    uint64_t offset = 0;
+    size_t len = 0;
+    int dst_fd = -1;
+    uint64_t dst_offset = 0;
+    std::string buf;
+    int err = 0; // errno of the failed call, 0 on success
+
+    void *arg = NULL; // left alone by the pool, for the submitter's own state
+};
+
+struct IoPool {
+    std::vector<std::thread> threads;
+    std::mutex mu;
+    std::condition_variable cv;
+    std::deque<IoTask *> todo;
+    std::vector<IoTask *> done;
+    int wake_fds[2] = {-1, -1}; // pipe, the loop polls wake_fds[0]
+    size_t inflight = 0; // submitted and not yet taken back, loop only
+};
+
+// starts nthreads workers, returns -1 if the pipe can't be created
+int32_t iopool_start(IoPool *pool, size_t nthreads);
+
+// hands the task to a worker, the caller must not touch it until it comes back
+void iopool_submit(IoPool *pool, IoTask *task);
+
+// moves every finished task into out and drains the wake up pipe
+void iopool_take_done(IoPool *pool, std::vector<IoTask *> *out);
+
+inline int iopool_wake_fd(IoPool *pool) {
+    return pool->wake_fds[0];
+}
@@ -0,0 +1,370 @@
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <arpa/inet.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <netinet/ip.h>
+#include "kvclient.h"
+
+// write size bytes from the buffer into the fd
+static int32_t write_all(int fd, const char *buf, size_t size) {
+    while (size > 0) {
+        ssize_t res = write(fd, buf, size);
+        if (res < 0 && errno == EINTR) {
+            continue;
+        }
+        if (res <= 0) {
+            // error
+            return -1;
+        }
+
+        size -= (size_t) res;
+        buf += res;
+    }
+    return 0;
+}
+
+static void cache_unlink(KVClient *client, KVCacheEntry *entry) {
+    if (entry->slot_prev) {
+        entry->slot_prev->slot_next = entry->slot_next;
+    } else {
+        client->cache_slots[entry->slot] = entry->slot_next;
+    }
+    if (entry->slot_next) {
+        entry->slot_next->slot_prev = entry->slot_prev;
+    }
+}
+
+static void cache_drop_key(KVClient *client, std::string_view key) {
+    KVCacheEntry *entry = client->cache.del(key);
+    if (entry) {
+        cache_unlink(client, entry);
+        delete entry;
+    }
+}
+
+static void cache_drop_slot(KVClient *client, uint32_t slot) {
+    if (slot >= client->cache_slots.size()) {
+        return;
+    }
+    KVCacheEntry *entry = client->cache_slots[slot];
+    while (entry) {
+        KVCacheEntry *next = entry->slot_next;
+        client->cache.del(entry->key);
+        delete entry;
+        entry = next;
+    }
+    client->cache_slots[slot] = NULL;
+}
+
+static void cache_clear(KVClient *client) {
+    client->cache.foreach([](KVCacheEntry *entry) { delete entry; });
+    client->cache.destroy();
+    for (KVCacheEntry *&head : client->cache_slots) {
+        head = NULL;
+    }
+}
+
+static void cache_put(KVClient *client, const std::string &key, const std::string &val) {
+    if (client->cache.size() >= client->cache_max || client->cache_slots.empty()) {
+        return;
+    }
+
+    // in bcast mode we only hear about keys under our prefixes
+    bool covered = client->prefixes.empty();
+    for (const std::string &prefix : client->prefixes) {
+        covered = covered || key.compare(0, prefix.size(), prefix) == 0;
+    }
+    if (!covered) {
+        return;
+    }
+
+    uint64_t hashcode = KVCacheMap::hash(key);
+    KVCacheEntry *entry = new KVCacheEntry();
+    entry->key = key;
+    entry->value = val;
+    entry->slot = (uint32_t)(hashcode & (client->cache_slots.size() - 1));
+    entry->slot_next = client->cache_slots[entry->slot];
+    if (entry->slot_next) {
+        entry->slot_next->slot_prev = entry;
+    }
+    client->cache_slots[entry->slot] = entry;
+    client->cache.put(entry, hashcode);
+}
+
+static void handle_push(KVClient *client, const std::string &msg) {
+    if (msg.size() < 2) {
+        return;
+    }
+    client->invalidations++;
+    if (msg[1] == PUSH_INVALIDATE_SLOT && msg.size() >= 6) {
+        uint32_t slot = 0;
+        memcpy(&slot, &msg[2], 4);
+        cache_drop_slot(client, slot);
+    } else if (msg[1] == PUSH_INVALIDATE_KEY && msg.size() >= 6) {
+        uint32_t len = 0;
+        memcpy(&len, &msg[2], 4);
+        if (6 + len <= msg.size()) {
+            cache_drop_key(client, std::string_view(&msg[6], len));
+        }
+    } else if (msg[1] == PUSH_TRACKING_FALLBACK) {
+        // the server forgot our slots, from now on it sends keys instead
+        cache_clear(client);
+    }
+}
+
+// reads whatever the socket has into read_buf. returns 1 if something was
+// read, 0 if there was nothing to read without blocking and -1 on errors.
+static int32_t fill_buffer(KVClient *client, bool block) {
+    char buf[4 + MAX_MSG_SIZE];
+    ssize_t res = 0;
+    do {
+        res = recv(client->fd, buf, sizeof(buf), block ? 0 : MSG_DONTWAIT);
+    } while (res < 0 && errno == EINTR);
+
+    if (res < 0 && !block && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+        return 0;
+    }
+    if (res <= 0) {
+        // error or EOF, whatever we cached can't be trusted anymore
+        cache_clear(client);
+        return -1;
+    }
+    client->read_buf.append(buf, (size_t) res);
+    return 1;
+}
+
+// moves the first complete message out of read_buf. returns 1 if there was
+// one, 0 if more bytes are needed and -1 if it is malformed.
+static int32_t pop_msg(KVClient *client, std::string *msg, bool pushes_only) {
+    std::string &buf = client->read_buf;
+    if (buf.size() < 4) {
+        return 0;
+    }
+    uint32_t len = 0;
+    memcpy(&len, buf.data(), 4);
+    if (len > MAX_MSG_SIZE) {
+        return -1;
+    }
+    if (buf.size() < 4 + len) {
+        return 0;
+    }
+    if (pushes_only && (len == 0 || buf[4] != SER_PUSH)) {
+        return 0;
+    }
+    msg->assign(buf, 4, len);
+    buf.erase(0, 4 + len);
+    return 1;
+}
+
+int32_t kv_connect_tcp(KVClient *client, uint32_t ip, uint16_t port) {
+    int fd = socket(AF_INET, SOCK_STREAM, 0);
+    if (fd < 0) {
+        return -1;
+    }
+
+    struct sockaddr_in addr = {};
+    addr.sin_family = AF_INET;
+    addr.sin_port = htons(port);
+    addr.sin_addr.s_addr = htonl(ip);
+    if (connect(fd, (const struct sockaddr *)&addr, sizeof(addr))) {
+        close(fd);
+        return -1;
+    }
+    client->fd = fd;
+    return 0;
+}
+
+int32_t kv_connect_unix(KVClient *client, const char *path) {
+    struct sockaddr_un addr = {};
+    size_t len = strlen(path);
+    if (len >= sizeof(addr.sun_path)) {
+        return -1;
+    }
+    int fd = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (fd < 0) {
+        return -1;
+    }
+
+    addr.sun_family = AF_UNIX;
+    memcpy(addr.sun_path, path, len);
+    if (connect(fd, (const struct sockaddr *)&addr, sizeof(addr))) {
+        close(fd);
+        return -1;
+    }
+    client->fd = fd;
+    return 0;
+}
+
+void kv_close(KVClient *client) {
+    if (client->fd >= 0) {
+        close(client->fd);
+    }
+    client->fd = -1;
+    client->read_buf.clear();
+    client->proto = PROTO_V1;
+    client->tracking = false;
+    cache_clear(client);
+    client->cache_slots.clear();
+    client->prefixes.clear();
+}
+
+int32_t kv_send_req(KVClient *client, const std::vector<std::string> &cmd) {
+    std::string buf;
+    if (client->proto == PROTO_V2) {
+        if (proto_encode_v2(&buf, cmd)) {
+            return -1;
+        }
+    } else {
+        proto_encode_v1(&buf, cmd);
+    }
+
+    // the server's limit is on the body, after the length prefix
+    uint32_t len = 0;
+    if (client->proto == PROTO_V2) {
+        varint_get((const uint8_t *) buf.data(), buf.size(), &len);
+    } else {
+        memcpy(&len, buf.data(), 4);
+    }
+    if (len > MAX_MSG_SIZE) {
+        return -1;
+    }
+    return write_all(client->fd, buf.data(), buf.size());
+}
+
+int32_t kv_read_res(KVClient *client, std::string *res) {
+    while (true) {
+        int32_t err = pop_msg(client, res, false);
+        if (err < 0) {
+            return err;
+        }
+        if (err == 0) {
+            if (fill_buffer(client, true) < 0) {
+                return -1;
+            }
+            continue;
+        }
+
+        if (!res->empty() && (*res)[0] == SER_PUSH) {
+            handle_push(client, *res);
+            continue;
+        }
+        return 0;
+    }
+}
+
+int32_t kv_call(KVClient *client, const std::vector<std::string> &cmd, std::string *res) {
+    int32_t err = kv_send_req(client, cmd);
+    if (err) {
+        return err;
+    }
+    return kv_read_res(client, res);
+}
+
+int32_t kv_poll_pushes(KVClient *client) {
+    while (true) {
+        int32_t res = fill_buffer(client, false);
+        if (res < 0) {
+            return res;
+        }
+        if (res == 0) {
+            break;
+        }
+    }
+
+    std::string msg;
+    int32_t res = 0;
+    while ((res = pop_msg(client, &msg, true)) > 0) {
+        handle_push(client, msg);
+    }
+    return res;
+}
+
+int32_t kv_hello(KVClient *client, uint32_t version) {
+    std::string res;
+    int32_t err = kv_call(client, {"hello", std::to_string(version)}, &res);
+    if (err) {
+        return err;
+    }
+    int64_t agreed = 0;
+    if (res.size() != 9 || res[0] != SER_INT) {
+        return -1;
+    }
+    memcpy(&agreed, &res[1], 8);
+    if (agreed != (int64_t) version) {
+        return -1;
+    }
+    client->proto = version;
+    return 0;
+}
+
+int32_t kv_enable_tracking(
+        KVClient *client,
+        size_t cache_max,
+        const std::vector<std::string> &prefixes
+    ) {
+    std::vector<std::string> cmd = {"client", "tracking", "on"};
+    if (!prefixes.empty()) {
+        cmd.push_back("bcast");
+        cmd.insert(cmd.end(), prefixes.begin(), prefixes.end());
+    }
+    std::string res;
+    int32_t err = kv_call(client, cmd, &res);
+    if (err) {
+        return err;
+    }
+    if (res.size() != 9 || res[0] != SER_INT) {
+        return -1;
+    }
+
+    // the reply is the number of slots the server groups keys by
+    int64_t slots = 0;
+    memcpy(&slots, &res[1], 8);
+    if (slots <= 0 || (slots & (slots - 1))) {
+        return -1;
+    }
+    cache_clear(client);
+    client->cache_slots.assign((size_t) slots, NULL);
+    client->cache_max = cache_max;
+    client->prefixes = prefixes;
+    client->tracking = true;
+    return 0;
+}
+
+int32_t kv_get(KVClient *client, const std::string &key, std::string *val) {
+    if (client->tracking) {
+        if (kv_poll_pushes(client) < 0) {
+            return -1;
+        }
+        KVCacheEntry *entry = client->cache.get(key);
+        if (entry) {
+            client->cache_hits++;
+            *val = entry->value;
+            return 1;
+        }
+        client->cache_misses++;
+    }
+
+    std::string res;
+    if (kv_call(client, {"get", key}, &res)) {
+        return -1;
+    }
+    if (res.size() == 1 && res[0] == SER_NIL) {
+        return 0;
+    }
+    if (res.size() < 5 || res[0] != SER_STR) {
+        return -1;
+    }
+    uint32_t len = 0;
+    memcpy(&len, &res[1], 4);
+    if (5 + len != res.size()) {
+        return -1;
+    }
+    val->assign(res, 5, len);
+    if (client->tracking) {
+        cache_put(client, key, *val);
+    }
+    return 1;
+}
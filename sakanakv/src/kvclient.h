@@ -0,0 +1,111 @@
+#pragma once
+
+#include <stddef.h>
+#include <stdint.h>
+#include <string>
+#include <string_view>
+#include <vector>
+#include "hashmap.h"
+#include "proto.h"
+
+/**
+ * Client library for talking to the server.
+ *
+ * Besides sending requests and reading replies it can keep a local cache of
+ * GET results. Once tracking is on, the server pushes invalidations for the
+ * cached keys; they are handled whenever a reply is read and before every
+ * cache hit, so a hit is never older than the last invalidation that had
+ * already reached us.
+ */
+
+const size_t MAX_MSG_SIZE = 4096;
+
+// indicates the type of data we are serialising
+enum {
+    SER_NIL = 0, // null
+    SER_ERR = 1, // err code and message
+    SER_STR = 2, // string
+    SER_INT = 3, // 64 bit integer
+    SER_ARR = 4, // array of strings
+    SER_PUSH = 5, // server initiated message, not a reply
+};
+
+// kinds of SER_PUSH messages
+enum {
+    PUSH_INVALIDATE_SLOT = 0, // u32 tracking slot
+    PUSH_INVALIDATE_KEY = 1, // u32 len + key
+    PUSH_TRACKING_FALLBACK = 2, // no payload, drop the whole cache
+};
+
+struct KVCacheEntry {
+    HashTableNode node;
+    std::string key;
+    std::string value;
+    uint32_t slot = 0;
+    // other cached keys in the same tracking slot
+    KVCacheEntry *slot_prev = NULL;
+    KVCacheEntry *slot_next = NULL;
+};
+
+struct KVCacheEntryEq {
+    bool operator()(const KVCacheEntry &entry, std::string_view key) const {
+        return entry.key == key;
+    }
+};
+
+typedef IntrusiveMap<KVCacheEntry, &KVCacheEntry::node, StringViewHash, KVCacheEntryEq> KVCacheMap;
+
+struct KVClient {
+    int fd = -1;
+    std::string read_buf; // bytes received but not yet handled
+    uint32_t proto = PROTO_V1; // how requests are framed, see kv_hello
+
+    // client side cache, only used once tracking is on
+    bool tracking = false;
+    size_t cache_max = 0;
+    KVCacheMap cache;
+    std::vector<KVCacheEntry *> cache_slots; // heads of the per slot lists
+    std::vector<std::string> prefixes; // only these get cached in bcast mode
+    uint64_t cache_hits = 0;
+    uint64_t cache_misses = 0;
+    uint64_t invalidations = 0;
+};
+
+// connects to the server on ip:port (both in host byte order)
+int32_t kv_connect_tcp(KVClient *client, uint32_t ip, uint16_t port);
+
+// connects to the server's unix socket, for clients on the same host
+int32_t kv_connect_unix(KVClient *client, const char *path);
+
+// closes the connection and drops the cache
+void kv_close(KVClient *client);
+
+// sends cmd, name first, framed in the connection's protocol version
+int32_t kv_send_req(KVClient *client, const std::vector<std::string> &cmd);
+
+// waits for the next reply and stores its payload in res.
+// invalidations that arrive first are applied on the way.
+int32_t kv_read_res(KVClient *client, std::string *res);
+
+// kv_send_req followed by kv_read_res
+int32_t kv_call(KVClient *client, const std::vector<std::string> &cmd, std::string *res);
+
+// applies any invalidations that already arrived, without blocking
+int32_t kv_poll_pushes(KVClient *client);
+
+// switches the connection to another request protocol, see proto.h.
+// PROTO_V2 makes requests smaller and cheaper for the server to parse.
+int32_t kv_hello(KVClient *client, uint32_t version);
+
+// turns on tracking and caches up to cache_max GET results. with prefixes
+// the server broadcasts changes to matching keys instead of remembering
+// what we read, and only matching keys get cached.
+int32_t kv_enable_tracking(
+    KVClient *client,
+    size_t cache_max,
+    const std::vector<std::string> &prefixes = {}
+);
+
+// GET through the local cache. returns 1 and fills val if the key exists,
+// 0 if it does not and -1 on errors.
+int32_t kv_get(KVClient *client, const std::string &key, std::string *val);
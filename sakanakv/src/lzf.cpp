@@ -0,0 +1,160 @@
+#include <string.h>
+#include "lzf.h"
+
+const size_t LZF_HASH_LOG = 13;
+const size_t LZF_HASH_SIZE = 1 << LZF_HASH_LOG;
+const size_t LZF_MAX_LIT = 32;
+const size_t LZF_MAX_OFF = 1 << 13;
+const size_t LZF_MAX_REF = (1 << 8) + (1 << 3);
+
+static uint32_t lzf_hash(const uint8_t *p) {
+    uint32_t v = p[0] | (p[1] << 8) | (p[2] << 16);
+    return (v * 2654435761u) >> (32 - LZF_HASH_LOG);
+}
+
+size_t lzf_compress(const uint8_t *in, size_t in_len, uint8_t *out, size_t out_len) {
+    // 1 + offset of the last occurrence of each 3 byte hash, 0 if unseen
+    uint32_t htab[LZF_HASH_SIZE] = {};
+
+    const uint8_t *ip = in;
+    const uint8_t *in_end = in + in_len;
+    uint8_t *op = out;
+    uint8_t *out_end = out + out_len;
+
+    // every literal run starts with a control byte we fill in once the
+    // run is closed
+    size_t lit = 0;
+    if (op >= out_end) {
+        return 0;
+    }
+    uint8_t *lit_ctrl = op++;
+
+    while (ip + 2 < in_end) {
+        uint32_t h = lzf_hash(ip);
+        const uint8_t *ref = htab[h] ? in + htab[h] - 1 : NULL;
+        htab[h] = (uint32_t)(ip - in) + 1;
+
+        size_t off = ref ? (size_t)(ip - ref - 1) : 0;
+        if (ref && off < LZF_MAX_OFF && memcmp(ref, ip, 3) == 0) {
+            size_t max_len = (size_t)(in_end - ip);
+            max_len = max_len < LZF_MAX_REF ? max_len : LZF_MAX_REF;
+            size_t len = 3;
+            while (len < max_len && ref[len] == ip[len]) {
+                len++;
+            }
+
+            // close the pending literal run, or drop its unused control byte
+            if (lit) {
+                *lit_ctrl = (uint8_t)(lit - 1);
+            } else {
+                op--;
+            }
+            lit = 0;
+
+            if (op + 3 + 1 > out_end) {
+                return 0;
+            }
+            size_t stored = len - 2;
+            if (stored < 7) {
+                *op++ = (uint8_t)((stored << 5) | (off >> 8));
+            } else {
+                *op++ = (uint8_t)((7 << 5) | (off >> 8));
+                *op++ = (uint8_t)(stored - 7);
+            }
+            *op++ = (uint8_t) off;
+
+            ip += len;
+            lit_ctrl = op++;
+            continue;
+        }
+
+        if (op >= out_end) {
+            return 0;
+        }
+        *op++ = *ip++;
+        if (++lit == LZF_MAX_LIT) {
+            *lit_ctrl = (uint8_t)(lit - 1);
+            lit = 0;
+            if (op >= out_end) {
+                return 0;
+            }
+            lit_ctrl = op++;
+        }
+    }
+
+    // the last couple of bytes are too short to match
+    while (ip < in_end) {
+        if (op >= out_end) {
+            return 0;
+        }
+        *op++ = *ip++;
+        if (++lit == LZF_MAX_LIT) {
+            *lit_ctrl = (uint8_t)(lit - 1);
+            lit = 0;
+            if (op >= out_end) {
+                return 0;
+            }
+            lit_ctrl = op++;
+        }
+    }
+
+    if (lit) {
+        *lit_ctrl = (uint8_t)(lit - 1);
+    } else {
+        op--;
+    }
+    return (size_t)(op - out);
+}
+
+size_t lzf_decompress(const uint8_t *in, size_t in_len, uint8_t *out, size_t out_len) {
+    const uint8_t *ip = in;
+    const uint8_t *in_end = in + in_len;
+    uint8_t *op = out;
+    uint8_t *out_end = out + out_len;
+
+    while (ip < in_end) {
+        size_t ctrl = *ip++;
+
+        if (ctrl < LZF_MAX_LIT) {
+            // literal run
+            size_t len = ctrl + 1;
+            if (ip + len > in_end || op + len > out_end) {
+                return 0;
+            }
+            memcpy(op, ip, len);
+            ip += len;
+            op += len;
+            continue;
+        }
+
+        // back reference
+        size_t len = ctrl >> 5;
+        if (len == 7) {
+            if (ip >= in_end) {
+                return 0;
+            }
+            len += *ip++;
+        }
+        if (ip >= in_end) {
+            return 0;
+        }
+        size_t off = ((ctrl & 0x1f) << 8) + *ip++ + 1;
+        len += 2;
+        if (off > (size_t)(op - out) || op + len > out_end) {
+            return 0;
+        }
+
+        // the source may overlap the bytes we are writing, in which case
+        // it has to be copied one byte at a time
+        const uint8_t *ref = op - off;
+        if (off >= len) {
+            memcpy(op, ref, len);
+        } else {
+            for (size_t i = 0; i < len; i++) {
+                op[i] = ref[i];
+            }
+        }
+        op += len;
+    }
+    return (size_t)(op - out);
+}
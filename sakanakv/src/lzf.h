@@ -0,0 +1,22 @@
+#pragma once
+
+#include <stddef.h>
+#include <stdint.h>
+
+/**
+ * Small LZ77 codec using the LZF stream format.
+ *
+ * The stream is a sequence of control bytes:
+ *   000LLLLL                literal run of L + 1 bytes follows
+ *   LLLooooo oooooooo       back reference of L + 2 bytes, L in 1..6
+ *   111ooooo LLLLLLLL oooooooo
+ *                           back reference of L + 9 bytes
+ * where o is the distance back from the current output position minus one.
+ */
+
+// returns the compressed size, or 0 if it does not fit in out_len bytes
+size_t lzf_compress(const uint8_t *in, size_t in_len, uint8_t *out, size_t out_len);
+
+// returns the decompressed size, or 0 if the input is corrupt or the
+// output does not fit in out_len bytes
+size_t lzf_decompress(const uint8_t *in, size_t in_len, uint8_t *out, size_t out_len);
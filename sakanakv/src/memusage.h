@@ -0,0 +1,18 @@
+#pragma once
+
+#include <stddef.h>
+#include <string>
+
+/**
+ * Helpers for the MEMORY command's accounting. Sizes count what a
+ * structure asks the allocator for, not the allocator's own overhead.
+ */
+
+// heap bytes behind a string, 0 while it fits in the string object itself
+inline size_t string_heap_bytes(const std::string &s) {
+    const char *inline_buf = (const char *)&s;
+    if (s.data() >= inline_buf && s.data() < inline_buf + sizeof(s)) {
+        return 0;
+    }
+    return s.capacity() + 1;
+}
@@ -0,0 +1,127 @@
+#include <string.h>
+#include <strings.h>
+#include "proto.h"
+
+const char *const PROTO_OP_NAMES[OP_COUNT] = {
+    "hello",
+    "keys",
+    "info",
+    "keyprefix",
+    "keyrange",
+    "get",
+    "set",
+    "del",
+    "hset",
+    "hget",
+    "hdel",
+    "hgetall",
+    "hlen",
+    "lpush",
+    "rpush",
+    "lpop",
+    "rpop",
+    "lrange",
+    "llen",
+    "pfadd",
+    "pfcount",
+    "pfmerge",
+    "client",
+    "memory",
+};
+
+int32_t proto_opcode(const char *name) {
+    for (int32_t op = 0; op < OP_COUNT; op++) {
+        if (strcasecmp(name, PROTO_OP_NAMES[op]) == 0) {
+            return op;
+        }
+    }
+    return -1;
+}
+
+int32_t proto_parse_v1(const uint8_t *data, size_t len, std::vector<std::string> &out) {
+    if (len < 4) {
+        // can't even read header
+        return -1;
+    }
+
+    uint32_t args_size = 0;
+    memcpy(&args_size, data, 4);
+    if (args_size > PROTO_MAX_ARGS) {
+        return -1;
+    }
+
+    size_t cur_pos = 4;
+    while (args_size--) {
+        if (cur_pos + 4 > len) {
+            return -1;
+        }
+        uint32_t size = 0;
+        memcpy(&size, &data[cur_pos], 4);
+        if (cur_pos + 4 + size > len) {
+            return -1;
+        }
+        out.push_back(std::string((char *) &data[cur_pos+4], size));
+        cur_pos += 4 + size;
+    }
+
+    if (cur_pos != len) {
+        return -1; // extra garbage trailing
+    }
+    return 0;
+}
+
+int32_t proto_parse_v2(const uint8_t *data, size_t len, uint32_t *op, std::vector<std::string> &out) {
+    if (len < 1 || data[0] >= OP_COUNT) {
+        return -1;
+    }
+    *op = data[0];
+    out.emplace_back(); // where v1 has the name
+
+    size_t cur_pos = 1;
+    while (cur_pos < len) {
+        uint32_t size = 0;
+        int32_t n = varint_get(&data[cur_pos], len - cur_pos, &size);
+        if (n <= 0 || cur_pos + n + size > len || out.size() > PROTO_MAX_ARGS) {
+            return -1;
+        }
+        cur_pos += (size_t) n;
+        out.emplace_back((const char *) &data[cur_pos], size);
+        cur_pos += size;
+    }
+    return 0;
+}
+
+void proto_encode_v1(std::string *out, const std::vector<std::string> &cmd) {
+    uint32_t len = 4;
+    for (const std::string &s : cmd) {
+        len += 4 + (uint32_t) s.size();
+    }
+    uint32_t arg_cnt = (uint32_t) cmd.size();
+    out->append((char *)&len, 4);
+    out->append((char *)&arg_cnt, 4);
+    for (const std::string &s : cmd) {
+        uint32_t size = (uint32_t) s.size();
+        out->append((char *)&size, 4);
+        out->append(s);
+    }
+}
+
+int32_t proto_encode_v2(std::string *out, const std::vector<std::string> &cmd) {
+    int32_t op = cmd.empty() ? -1 : proto_opcode(cmd[0].c_str());
+    if (op < 0) {
+        return -1;
+    }
+
+    // size the body first so it can be written straight into out
+    uint32_t len = 1;
+    for (size_t i = 1; i < cmd.size(); i++) {
+        len += varint_size((uint32_t) cmd[i].size()) + (uint32_t) cmd[i].size();
+    }
+    varint_put(out, len);
+    out->push_back((char) op);
+    for (size_t i = 1; i < cmd.size(); i++) {
+        varint_put(out, (uint32_t) cmd[i].size());
+        out->append(cmd[i]);
+    }
+    return 0;
+}
@@ -0,0 +1,112 @@
+#pragma once
+
+#include <stddef.h>
+#include <stdint.h>
+#include <string>
+#include <vector>
+
+/**
+ * Request framing, shared by the server and its clients.
+ *
+ * Every connection starts out speaking v1:
+ *   [u32 len][u32 nargs]([u32 arg len][arg bytes])...
+ * where the first arg is the command name as text and len covers
+ * everything after itself.
+ *
+ * A client that sends HELLO 2 (and gets the int 2 back) speaks v2 from its
+ * next request on:
+ *   [varint len][u8 opcode]([varint arg len][arg bytes])...
+ * The opcode replaces the command name and the arg count is implied by
+ * len. Varints are little endian base 128, 7 bits per byte with the high
+ * bit set on all but the last. A GET of a 16 byte key takes 19 bytes
+ * instead of 35. HELLO 1 switches back.
+ *
+ * Replies are framed the same way in both versions.
+ */
+
+// opcodes of v2 requests. v1 requests are mapped onto them by name. only
+// ever add to the end, the numbers are on the wire.
+enum {
+    OP_HELLO = 0,
+    OP_KEYS,
+    OP_INFO,
+    OP_KEYPREFIX,
+    OP_KEYRANGE,
+    OP_GET,
+    OP_SET,
+    OP_DEL,
+    OP_HSET,
+    OP_HGET,
+    OP_HDEL,
+    OP_HGETALL,
+    OP_HLEN,
+    OP_LPUSH,
+    OP_RPUSH,
+    OP_LPOP,
+    OP_RPOP,
+    OP_LRANGE,
+    OP_LLEN,
+    OP_PFADD,
+    OP_PFCOUNT,
+    OP_PFMERGE,
+    OP_CLIENT,
+    OP_MEMORY,
+    OP_COUNT,
+};
+
+const uint32_t PROTO_V1 = 1;
+const uint32_t PROTO_V2 = 2;
+
+const size_t PROTO_MAX_ARGS = 1024;
+
+// command names by opcode, lower case
+extern const char *const PROTO_OP_NAMES[OP_COUNT];
+
+// the opcode of a command name, ignoring case, or -1
+int32_t proto_opcode(const char *name);
+
+inline uint32_t varint_size(uint32_t val) {
+    uint32_t size = 1;
+    while (val >= 0x80) {
+        val >>= 7;
+        size++;
+    }
+    return size;
+}
+
+inline void varint_put(std::string *out, uint32_t val) {
+    while (val >= 0x80) {
+        out->push_back((char)(val | 0x80));
+        val >>= 7;
+    }
+    out->push_back((char) val);
+}
+
+// decodes a varint at the start of data. returns the bytes it took, 0 if
+// data ends before it does and -1 if it doesn't fit 32 bits.
+inline int32_t varint_get(const uint8_t *data, size_t len, uint32_t *val) {
+    uint32_t res = 0;
+    for (size_t i = 0; i < len && i < 5; i++) {
+        res |= (uint32_t)(data[i] & 0x7f) << (7 * i);
+        if (!(data[i] & 0x80)) {
+            if (i == 4 && data[i] > 0x0f) {
+                return -1;
+            }
+            *val = res;
+            return (int32_t)(i + 1);
+        }
+    }
+    return len < 5 ? 0 : -1;
+}
+
+// parses a request body, without its length prefix, into out. v1 puts the
+// command name in out[0], v2 leaves out[0] empty and sets *op.
+int32_t proto_parse_v1(const uint8_t *data, size_t len, std::vector<std::string> &out);
+int32_t proto_parse_v2(const uint8_t *data, size_t len, uint32_t *op, std::vector<std::string> &out);
+
+// appends cmd framed as a v1 request, length prefix included
+void proto_encode_v1(std::string *out, const std::vector<std::string> &cmd);
+
+// appends cmd, name first like in v1, framed as a v2 request. returns -1
+// if there is no opcode for the name.
+int32_t proto_encode_v2(std::string *out, const std::vector<std::string> &cmd);
@@ -0,0 +1,158 @@
+#include <stdlib.h>
+#include "quicklist.h"
+
+static QuickListChunk *chunk_new(size_t cap, bool at_front) {
+    QuickListChunk *chunk = (QuickListChunk *)malloc(sizeof(QuickListChunk) + cap);
+    chunk->prev = NULL;
+    chunk->next = NULL;
+    chunk->count = 0;
+    chunk->cap = (uint32_t) cap;
+    // leave the free space on the side the list will grow towards
+    chunk->start = at_front ? (uint32_t) cap : 0;
+    chunk->end = chunk->start;
+    return chunk;
+}
+
+static void chunk_write(QuickListChunk *chunk, size_t pos, std::string_view val) {
+    uint32_t len = (uint32_t) val.size();
+    memcpy(&chunk->data[pos], &len, 4);
+    memcpy(&chunk->data[pos + 4], val.data(), val.size());
+    memcpy(&chunk->data[pos + 4 + len], &len, 4);
+}
+
+static void ql_unlink(QuickList *ql, QuickListChunk *chunk) {
+    if (chunk->prev) {
+        chunk->prev->next = chunk->next;
+    } else {
+        ql->head = chunk->next;
+    }
+    if (chunk->next) {
+        chunk->next->prev = chunk->prev;
+    } else {
+        ql->tail = chunk->prev;
+    }
+    ql->chunks--;
+    free(chunk);
+}
+
+void ql_push_front(QuickList *ql, std::string_view val) {
+    size_t need = QL_ELEM_OVERHEAD + val.size();
+    QuickListChunk *chunk = ql->head;
+    if (chunk && chunk->start < need && chunk->end - chunk->start + need <= chunk->cap) {
+        // there is room at the back, slide the elements over to use it
+        size_t used = chunk->end - chunk->start;
+        memmove(&chunk->data[chunk->cap - used], &chunk->data[chunk->start], used);
+        chunk->start = chunk->cap - (uint32_t) used;
+        chunk->end = chunk->cap;
+    }
+    if (!chunk || chunk->start < need) {
+        chunk = chunk_new(need > QL_CHUNK_BYTES ? need : QL_CHUNK_BYTES, true);
+        chunk->next = ql->head;
+        if (ql->head) {
+            ql->head->prev = chunk;
+        } else {
+            ql->tail = chunk;
+        }
+        ql->head = chunk;
+        ql->chunks++;
+    }
+
+    chunk->start -= (uint32_t) need;
+    chunk_write(chunk, chunk->start, val);
+    chunk->count++;
+    ql->len++;
+}
+
+void ql_push_back(QuickList *ql, std::string_view val) {
+    size_t need = QL_ELEM_OVERHEAD + val.size();
+    QuickListChunk *chunk = ql->tail;
+    if (chunk && chunk->cap - chunk->end < need && chunk->end - chunk->start + need <= chunk->cap) {
+        // there is room at the front, slide the elements over to use it
+        size_t used = chunk->end - chunk->start;
+        memmove(&chunk->data[0], &chunk->data[chunk->start], used);
+        chunk->start = 0;
+        chunk->end = (uint32_t) used;
+    }
+    if (!chunk || chunk->cap - chunk->end < need) {
+        chunk = chunk_new(need > QL_CHUNK_BYTES ? need : QL_CHUNK_BYTES, false);
+        chunk->prev = ql->tail;
+        if (ql->tail) {
+            ql->tail->next = chunk;
+        } else {
+            ql->head = chunk;
+        }
+        ql->tail = chunk;
+        ql->chunks++;
+    }
+
+    chunk_write(chunk, chunk->end, val);
+    chunk->end += (uint32_t) need;
+    chunk->count++;
+    ql->len++;
+}
+
+bool ql_pop_front(QuickList *ql, std::string *out) {
+    QuickListChunk *chunk = ql->head;
+    if (!chunk) {
+        return false;
+    }
+
+    uint32_t len = 0;
+    memcpy(&len, &chunk->data[chunk->start], 4);
+    out->assign((const char *)&chunk->data[chunk->start + 4], len);
+    chunk->start += (uint32_t) QL_ELEM_OVERHEAD + len;
+    chunk->count--;
+    ql->len--;
+    if (chunk->count == 0) {
+        ql_unlink(ql, chunk);
+    }
+    return true;
+}
+
+bool ql_pop_back(QuickList *ql, std::string *out) {
+    QuickListChunk *chunk = ql->tail;
+    if (!chunk) {
+        return false;
+    }
+
+    // the trailing copy of the length lets us find the start of the element
+    uint32_t len = 0;
+    memcpy(&len, &chunk->data[chunk->end - 4], 4);
+    chunk->end -= (uint32_t) QL_ELEM_OVERHEAD + len;
+    out->assign((const char *)&chunk->data[chunk->end + 4], len);
+    chunk->count--;
+    ql->len--;
+    if (chunk->count == 0) {
+        ql_unlink(ql, chunk);
+    }
+    return true;
+}
+
+size_t ql_len(QuickList *ql) {
+    return ql->len;
+}
+
+size_t ql_mem_usage(QuickList *ql, size_t samples) {
+    size_t seen = 0;
+    size_t chunk_bytes = 0;
+    QuickListChunk *chunk = ql->head;
+    for (; chunk && (!samples || seen < samples); chunk = chunk->next) {
+        chunk_bytes += sizeof(QuickListChunk) + chunk->cap;
+        seen++;
+    }
+    size_t bytes = sizeof(QuickList);
+    if (seen) {
+        bytes += chunk_bytes * ql->chunks / seen;
+    }
+    return bytes;
+}
+
+void ql_destroy(QuickList *ql) {
+    QuickListChunk *chunk = ql->head;
+    while (chunk) {
+        QuickListChunk *next = chunk->next;
+        free(chunk);
+        chunk = next;
+    }
+    *ql = QuickList{};
+}
@@ -0,0 +1,87 @@
+#pragma once
+
+#include <stddef.h>
+#include <stdint.h>
+#include <string.h>
+#include <string>
+#include <string_view>
+
+/**
+ * List value type, stored as a doubly linked list of packed chunks.
+ *
+ * Every chunk owns a fixed size byte buffer holding a run of elements. An
+ * element is laid out as [u32 len][bytes][u32 len] so it can be walked from
+ * either end. The used bytes of a chunk sit in [start, end) of its buffer:
+ * pushes to the front grow start downwards and pushes to the back grow end
+ * upwards, so both ends stay O(1) and a range scan over a chunk is a
+ * sequential read.
+ */
+
+// default buffer size of a chunk, elements bigger than this get their own
+const size_t QL_CHUNK_BYTES = 2048;
+
+// per element framing overhead
+const size_t QL_ELEM_OVERHEAD = 8;
+
+struct QuickListChunk {
+    QuickListChunk *prev;
+    QuickListChunk *next;
+    uint32_t count; // number of elements in the chunk
+    uint32_t cap; // size of data
+    uint32_t start; // first used byte
+    uint32_t end; // one past the last used byte
+    uint8_t data[];
+};
+
+struct QuickList {
+    QuickListChunk *head = NULL;
+    QuickListChunk *tail = NULL;
+    size_t len = 0; // number of elements
+    size_t chunks = 0;
+};
+
+void ql_push_front(QuickList *ql, std::string_view val);
+
+void ql_push_back(QuickList *ql, std::string_view val);
+
+// returns false if the list is empty
+bool ql_pop_front(QuickList *ql, std::string *out);
+
+bool ql_pop_back(QuickList *ql, std::string *out);
+
+size_t ql_len(QuickList *ql);
+
+// bytes used by the list, the QuickList itself included. a list with more
+// than samples chunks is estimated from the first samples of them, 0
+// measures every chunk.
+size_t ql_mem_usage(QuickList *ql, size_t samples);
+
+// frees every chunk, but not the QuickList itself
+void ql_destroy(QuickList *ql);
+
+// calls funct(val) for count elements starting from index start
+template <typename F>
+inline void ql_foreach_range(QuickList *ql, size_t start, size_t count, F &&funct) {
+    // skip whole chunks until we reach the one holding start
+    QuickListChunk *chunk = ql->head;
+    while (chunk && start >= chunk->count) {
+        start -= chunk->count;
+        chunk = chunk->next;
+    }
+
+    while (chunk && count > 0) {
+        size_t pos = chunk->start;
+        while (pos < chunk->end && count > 0) {
+            uint32_t len = 0;
+            memcpy(&len, &chunk->data[pos], 4);
+            if (start > 0) {
+                start--;
+            } else {
+                funct(std::string_view((const char *)&chunk->data[pos + 4], len));
+                count--;
+            }
+            pos += QL_ELEM_OVERHEAD + len;
+        }
+        chunk = chunk->next;
+    }
+}
@@ -0,0 +1,292 @@
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdio.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <time.h>
+#include <unistd.h>
+#include <arpa/inet.h>
+#include <algorithm>
+#include <deque>
+#include <string>
+#include <unordered_map>
+#include <vector>
+#include "kvclient.h"
+#include "trace.h"
+#include "proto.h"
+
+/**
+ * Replays a trace captured with the server's --capture option.
+ *
+ * usage: ./replay [-s PATH] [--speed X | --fast] TRACE
+ *
+ * Every connection in the trace gets a connection of its own to the server
+ * (127.0.0.1:3535, or the unix socket at PATH) and sends its requests in
+ * their original order. By default each request goes out when it did
+ * during the capture, whether or not earlier replies are in, just like a
+ * pipelining client would have. --speed 2 halves every gap. --fast sends
+ * each request as soon as the previous reply on its connection is in.
+ *
+ * Connections that switched protocols with HELLO during the capture switch
+ * at the same point in the replay.
+ *
+ * Latency is measured from when a request was due rather than when it was
+ * sent, so a server that falls behind can't hide it by slowing us down.
+ */
+
+struct ReplayConn {
+    KVClient client;
+    std::vector<const TraceRecord *> reqs;
+    size_t next = 0; // next request to send
+    uint32_t proto = PROTO_V1; // how the next request is framed
+    std::deque<uint64_t> inflight; // when the requests awaiting replies were due
+    std::string out; // framed requests, not fully written yet
+    size_t out_sent = 0;
+    std::string in; // reply bytes read so far
+};
+
+static void die(const char *msg) {
+    fprintf(stderr, "[%d] %s\n", errno, msg);
+    exit(1);
+}
+
+static uint64_t now_ns() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000 + (uint64_t)ts.tv_nsec;
+}
+
+static void usage_die() {
+    fprintf(stderr, "usage: ./replay [-s PATH] [--speed X | --fast] TRACE\n");
+    exit(1);
+}
+
+// the protocol a connection speaks after sending req, which was framed in
+// proto. only a successful HELLO changes it.
+static uint32_t proto_after(uint32_t proto, const std::string &req) {
+    if (req.size() > 32) {
+        return proto; // way too long for a HELLO, don't bother parsing
+    }
+    std::vector<std::string> cmd;
+    uint32_t op = 0;
+    const uint8_t *data = (const uint8_t *) req.data();
+    int32_t err = proto == PROTO_V2
+        ? proto_parse_v2(data, req.size(), &op, cmd)
+        : proto_parse_v1(data, req.size(), cmd);
+    if (err || cmd.size() != 2) {
+        return proto;
+    }
+    if (proto == PROTO_V1 && proto_opcode(cmd[0].c_str()) != OP_HELLO) {
+        return proto;
+    }
+    if (proto == PROTO_V2 && op != OP_HELLO) {
+        return proto;
+    }
+    uint32_t version = (uint32_t) strtoul(cmd[1].c_str(), NULL, 10);
+    return version == PROTO_V1 || version == PROTO_V2 ? version : proto;
+}
+
+static void try_write(ReplayConn *conn) {
+    while (conn->out_sent < conn->out.size()) {
+        ssize_t res = write(conn->client.fd, &conn->out[conn->out_sent],
+            conn->out.size() - conn->out_sent);
+        if (res < 0 && errno == EINTR) {
+            continue;
+        }
+        if (res < 0 && errno == EAGAIN) {
+            return;
+        }
+        if (res < 0) {
+            die("write()");
+        }
+        conn->out_sent += (size_t) res;
+    }
+    conn->out.clear();
+    conn->out_sent = 0;
+}
+
+// reads what's there and records the latency of every request whose reply
+// is complete
+static void try_read(ReplayConn *conn, std::vector<uint64_t> *latencies) {
+    char buf[4 + MAX_MSG_SIZE];
+    while (true) {
+        ssize_t res = read(conn->client.fd, buf, sizeof(buf));
+        if (res < 0 && errno == EINTR) {
+            continue;
+        }
+        if (res < 0 && errno == EAGAIN) {
+            break;
+        }
+        if (res <= 0) {
+            die("server closed the connection");
+        }
+        conn->in.append(buf, (size_t) res);
+    }
+
+    uint64_t now = now_ns();
+    while (conn->in.size() >= 4) {
+        uint32_t len = 0;
+        memcpy(&len, conn->in.data(), 4);
+        if (conn->in.size() < 4 + len) {
+            break;
+        }
+        // invalidations for traced CLIENT TRACKING calls aren't replies
+        bool push = len > 0 && conn->in[4] == SER_PUSH;
+        conn->in.erase(0, 4 + len);
+        if (push) {
+            continue;
+        }
+        if (conn->inflight.empty()) {
+            die("reply without a request");
+        }
+        latencies->push_back(now - conn->inflight.front());
+        conn->inflight.pop_front();
+    }
+}
+
+static double percentile(const std::vector<uint64_t> &sorted, double p) {
+    if (sorted.empty()) {
+        return 0;
+    }
+    size_t idx = (size_t)(p / 100.0 * (double)(sorted.size() - 1) + 0.5);
+    return (double) sorted[idx] / 1000.0;
+}
+
+int main(int argc, char **argv) {
+    const char *unix_path = NULL;
+    const char *trace_path = NULL;
+    double speed = 1.0;
+    bool fast = false;
+    for (int i = 1; i < argc; i++) {
+        if (strcmp(argv[i], "-s") == 0 && i + 1 < argc) {
+            unix_path = argv[++i];
+        } else if (strcmp(argv[i], "--speed") == 0 && i + 1 < argc) {
+            speed = strtod(argv[++i], NULL);
+            if (speed <= 0) {
+                usage_die();
+            }
+        } else if (strcmp(argv[i], "--fast") == 0) {
+            fast = true;
+        } else if (!trace_path && argv[i][0] != '-') {
+            trace_path = argv[i];
+        } else {
+            usage_die();
+        }
+    }
+    if (!trace_path) {
+        usage_die();
+    }
+
+    std::vector<TraceRecord> records;
+    if (trace_load(trace_path, &records)) {
+        die("not a trace");
+    }
+    if (records.empty()) {
+        printf("empty trace\n");
+        return 0;
+    }
+
+    // group the requests by connection, keeping their order
+    std::unordered_map<uint32_t, size_t> conn_idx;
+    std::vector<ReplayConn *> conns;
+    for (const TraceRecord &rec : records) {
+        auto it = conn_idx.find(rec.conn_id);
+        if (it == conn_idx.end()) {
+            it = conn_idx.emplace(rec.conn_id, conns.size()).first;
+            conns.push_back(new ReplayConn());
+        }
+        conns[it->second]->reqs.push_back(&rec);
+    }
+    for (ReplayConn *conn : conns) {
+        int32_t err = unix_path
+            ? kv_connect_unix(&conn->client, unix_path)
+            : kv_connect_tcp(&conn->client, INADDR_LOOPBACK, 3535);
+        if (err) {
+            die("connect()");
+        }
+        fcntl(conn->client.fd, F_SETFL, fcntl(conn->client.fd, F_GETFL, 0) | O_NONBLOCK);
+    }
+
+    std::vector<uint64_t> latencies;
+    latencies.reserve(records.size());
+    std::vector<struct pollfd> poll_args(conns.size());
+    uint64_t first_ts = records.front().ts_ns;
+    uint64_t start = now_ns();
+    while (latencies.size() < records.size()) {
+        // send whatever is due, and find out when the next one is
+        uint64_t now = now_ns();
+        uint64_t wait_ns = UINT64_MAX;
+        for (ReplayConn *conn : conns) {
+            while (conn->next < conn->reqs.size()) {
+                if (fast && !conn->inflight.empty()) {
+                    break;
+                }
+                const TraceRecord *rec = conn->reqs[conn->next];
+                uint64_t due = fast
+                    ? now
+                    : start + (uint64_t)((double)(rec->ts_ns - first_ts) / speed);
+                if (due > now) {
+                    wait_ns = std::min(wait_ns, due - now);
+                    break;
+                }
+                uint32_t len = (uint32_t) rec->req.size();
+                if (conn->proto == PROTO_V2) {
+                    varint_put(&conn->out, len);
+                } else {
+                    conn->out.append((char *)&len, 4);
+                }
+                conn->out.append(rec->req);
+                conn->proto = proto_after(conn->proto, rec->req);
+                conn->inflight.push_back(due);
+                conn->next++;
+            }
+            try_write(conn);
+        }
+
+        for (size_t i = 0; i < conns.size(); i++) {
+            ReplayConn *conn = conns[i];
+            poll_args[i].fd = conn->client.fd;
+            poll_args[i].events = conn->out_sent < conn->out.size() ? POLLIN | POLLOUT : POLLIN;
+            poll_args[i].revents = 0;
+        }
+        struct timespec timeout = {};
+        if (wait_ns != UINT64_MAX) {
+            timeout.tv_sec = (time_t)(wait_ns / 1000000000);
+            timeout.tv_nsec = (long)(wait_ns % 1000000000);
+        }
+        int res = ppoll(poll_args.data(), (nfds_t) poll_args.size(),
+            wait_ns == UINT64_MAX ? NULL : &timeout, NULL);
+        if (res < 0 && errno != EINTR) {
+            die("poll()");
+        }
+
+        for (size_t i = 0; i < conns.size(); i++) {
+            ReplayConn *conn = conns[i];
+            if (poll_args[i].revents & POLLOUT) {
+                try_write(conn);
+            }
+            if (!(poll_args[i].revents & (POLLIN | POLLERR | POLLHUP))) {
+                continue;
+            }
+            try_read(conn, &latencies);
+        }
+    }
+    uint64_t elapsed = now_ns() - start;
+
+    std::sort(latencies.begin(), latencies.end());
+    printf("requests      %zu over %zu connections\n", records.size(), conns.size());
+    printf("trace time    %.3f s\n", (double)(records.back().ts_ns - first_ts) / 1e9);
+    printf("replay time   %.3f s\n", (double) elapsed / 1e9);
+    printf("throughput    %.0f req/s\n", (double) records.size() * 1e9 / (double) elapsed);
+    printf("latency us    p50 %.1f  p90 %.1f  p99 %.1f  p99.9 %.1f  max %.1f\n",
+        percentile(latencies, 50), percentile(latencies, 90), percentile(latencies, 99),
+        percentile(latencies, 99.9), percentile(latencies, 100));
+
+    for (ReplayConn *conn : conns) {
+        kv_close(&conn->client);
+        delete conn;
+    }
+    return 0;
+}
@@ -6,26 +6,46 @@
 #include <fcntl.h>
 #include <poll.h>
 #include <unistd.h>
+#include <time.h>
 #include <arpa/inet.h>
 #include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
 #include <netinet/ip.h>
+#include <netinet/tcp.h>
+#include <algorithm>
+#include <atomic>
 #include <string>
+#include <thread>
 #include <vector>
 #include <iostream>
-# include "hashmap.h"
-
-// macro to convert Nodes to Entries
-#define container_of(ptr, type, member) ({                  \
-    const typeof( ((type *)0)->member ) *__mptr = (ptr);    \
-    (type *)( (char *)__mptr - offsetof(type, member) );})
+#include <string_view>
+#include "hashmap.h"
+#include "hashobj.h"
+#include "quicklist.h"
+#include "hyperloglog.h"
+#include "lzf.h"
+#include "avl.h"
+#include "tracking.h"
+#include "dlist.h"
+#include "iopool.h"
+#include "valuelog.h"
+#include "trace.h"
+#include "epoch.h"
+#include "chashmap.h"
+#include "proto.h"
+#include "memusage.h"
 
 const size_t MAX_MSG_SIZE = 4096;
-const size_t MAX_ARGS_SIZE = 1024;
+
+// room in the write buffer for invalidations pushed while a client is idle
+const size_t MAX_PUSH_SIZE = 1024;
 
 enum {
     STATE_REQ = 0,
     STATE_RES = 1,
-    STATE_END = 2
+    STATE_END = 2,
+    STATE_WAIT = 3 // a reply is waiting on the I/O pool
 };
 
 // indicates the type of data we are serialising
@@ -35,23 +55,33 @@ enum {
     SER_STR = 2, // string
     SER_INT = 3, // 64 bit integer
     SER_ARR = 4, // array of strings
+    SER_PUSH = 5, // server initiated message, not a reply
+};
+
+// kinds of SER_PUSH messages
+enum {
+    PUSH_INVALIDATE_SLOT = 0, // u32 tracking slot
+    PUSH_INVALIDATE_KEY = 1, // u32 len + key
+    PUSH_TRACKING_FALLBACK = 2, // no payload, drop the whole cache
 };
 
 // error responses
 enum {
     ERR_UNKNOWN = 0,
-    ERR_TOO_BIG = 1
+    ERR_TOO_BIG = 1,
+    ERR_TYPE = 2,
+    ERR_ARG = 3
 };
 
 static void output_nil(std::string &output) {
     output.push_back(SER_NIL);
 }
 
-static void output_str(std::string &output, const std::string &val) {
+static void output_str(std::string &output, std::string_view val) {
     output.push_back(SER_STR);
     uint32_t len = (uint32_t) val.size();
     output.append((char *)&len, 4);
-    output.append(val);
+    output.append(val.data(), val.size());
 }
 
 static void output_int(std::string &output, int64_t val) {
@@ -72,14 +102,26 @@ static void output_arr_size(std::string &output, uint32_t size) {
     output.append((char *)&size, 4);
 }
 
+// client side caching modes
+enum {
+    TRACK_OFF = 0,
+    TRACK_SLOTS = 1, // invalidate the slots of keys the client read
+    TRACK_BCAST = 2, // invalidate every key matching the client's prefixes
+    TRACK_FALLBACK = 3 // TRACK_SLOTS past the cap, subscribed to what it reads
+};
+
 struct Conn {
     int fd = -1;
+    uint32_t id; // unlike the fd never reused, for traces
     uint32_t state = 0;
+    uint32_t tracking; // TRACK_*
+    uint32_t proto; // PROTO_V1 or PROTO_V2, changed by HELLO
+    bool io_pending; // an I/O task refers to this conn, don't free it yet
     size_t read_buf_size; // number of bytes saved in read buffer
     uint8_t read_buf[4+MAX_MSG_SIZE];
     size_t write_buf_size; // number of bytes stored in write buffer
     size_t write_buf_sent; // number of bytes written from the write buffer
-    uint8_t write_buf[4+MAX_MSG_SIZE];
+    uint8_t write_buf[4+MAX_MSG_SIZE+MAX_PUSH_SIZE];
 };
 
 static void die(const char *msg) {
@@ -95,272 +137,1642 @@ static void fd_set_nonblocking(int fd) {
         return;
     }
 
-    flags |= O_NONBLOCK; // add the NONBLOCK flag
+    flags |= O_NONBLOCK; // add the NONBLOCK flag
+
+    errno = 0;
+    fcntl(fd, F_SETFL, flags);
+    if (errno) {
+        die("fcntl error");
+        return;
+    }
+}
+
+static bool try_flush_buffer(Conn *conn) {
+    ssize_t res = 0;
+    do {
+        size_t remaining_bytes = conn->write_buf_size - conn->write_buf_sent;
+        res = write(conn->fd, &conn->write_buf[conn->write_buf_sent], remaining_bytes);
+    } while (res < 0 && errno == EINTR);
+
+    if (res < 0 && errno == EAGAIN) {
+        return false;
+    }
+
+    if (res < 0) {
+        printf("write() error");
+        conn->state = STATE_END;
+        return false;
+    }
+
+    conn->write_buf_sent += (size_t) res;
+    if (conn->write_buf_sent == conn->write_buf_size) {
+        // change state back since msg has been fully sent
+        conn->state = STATE_REQ;
+        conn->write_buf_sent = 0;
+        conn->write_buf_size = 0;
+        return false;
+    }
+
+    // try write again
+    return true;
+}
+
+static void handle_state_res(Conn *conn) {
+    while (try_flush_buffer(conn)) {}
+}
+
+enum {
+    RES_OK = 0,
+    RES_ERR = 1,
+    RES_NX = 2
+};
+
+// value types
+enum {
+    T_STR = 0,
+    T_HASH = 1,
+    T_LIST = 2,
+    T_HLL = 3
+};
+
+// where a T_STR value is stored
+enum {
+    TIER_HOT = 0, // in memory
+    TIER_COLD = 1 // in the value log
+};
+
+// how a T_STR value is stored
+enum {
+    ENC_RAW = 0,
+    ENC_LZF = 1 // value holds lzf compressed bytes of raw_len bytes
+};
+
+struct Entry {
+    struct HashTableNode node;
+    std::string key;
+    uint32_t type = T_STR;
+    uint32_t encoding = ENC_RAW;
+    uint32_t raw_len = 0;
+    std::string value;
+    HashObj *hash = NULL;
+    QuickList *list = NULL;
+    HyperLogLog *hll = NULL;
+    AVLNode index_node; // only linked when the ordered index is on
+
+    // tiered storage. a cold string keeps only where its value lives in the
+    // value log, value itself is empty. type, encoding and raw_len stay.
+    uint32_t tier = TIER_HOT;
+    uint64_t last_access = 0; // monotonic ms, kept for spillable values
+    uint64_t spill_id = 0; // the spill in flight for this value, 0 if none
+    ValueSegment *cold_seg = NULL;
+    uint64_t cold_off = 0; // start of the record
+    uint32_t cold_len = 0; // stored value bytes
+    DList tier_node; // in data.lru while hot, in cold_seg->records while cold
+};
+
+struct EntryEq {
+    bool operator()(const Entry &entry, std::string_view key) const {
+        return entry.key == key;
+    }
+};
+
+struct EntryKey {
+    std::string_view operator()(const Entry &entry) const {
+        return entry.key;
+    }
+};
+
+typedef IntrusiveMap<Entry, &Entry::node, StringViewHash, EntryEq> EntryMap;
+typedef OrderedIndex<Entry, &Entry::index_node, EntryKey> EntryIndex;
+
+// a string in the keyspace shared by --threads loops. never changed once
+// it's in the map, a set swaps in a new one and retires the old.
+struct SharedEntry {
+    std::string key;
+    std::string value;
+};
+
+struct SharedEntryEq {
+    bool operator()(const SharedEntry &entry, std::string_view key) const {
+        return entry.key == key;
+    }
+};
+
+typedef ConcurrentHashMap<SharedEntry, StringViewHash, SharedEntryEq> SharedMap;
+
+// memory used by the keys sharing a prefix, see memscan_step
+struct PrefixStat {
+    HashTableNode node;
+    std::string prefix;
+    uint64_t keys = 0;
+    uint64_t bytes = 0;
+    std::string largest_key;
+    uint64_t largest_bytes = 0;
+};
+
+struct PrefixStatEq {
+    bool operator()(const PrefixStat &stat, std::string_view prefix) const {
+        return stat.prefix == prefix;
+    }
+};
+
+typedef IntrusiveMap<PrefixStat, &PrefixStat::node, StringViewHash, PrefixStatEq> PrefixStatMap;
+
+struct MemTotals {
+    uint64_t keys = 0;
+    uint64_t entry_bytes = 0;
+    uint64_t key_bytes = 0;
+    uint64_t value_bytes = 0;
+};
+
+// a pass over the keyspace adding up what every key uses, a few buckets
+// per loop iteration
+struct MemScan {
+    bool running = false;
+    // the ht1 being walked. a resize replaces it, which restarts the pass
+    HashTableNode **table = NULL;
+    size_t mask = 0;
+    size_t pos = 0; // next bucket
+    MemTotals totals;
+    PrefixStatMap prefixes;
+
+    // the last finished pass
+    bool done = false;
+    uint64_t done_ms = 0;
+    MemTotals last;
+    std::vector<PrefixStat> top; // most bytes first
+};
+
+static struct {
+    EntryMap db;
+    EntryIndex index; // keys in lexicographic order
+    Tracking tracking; // who to invalidate when a key changes
+    SharedMap shared; // the keyspace instead of db with --threads
+
+    // tiered storage
+    ValueLog vlog;
+    IoPool io;
+    DList lru; // hot spillable strings, least recently used first
+    uint64_t spill_seq = 0;
+    size_t tier_write_bytes = 0; // spills and compaction copies in flight
+
+    std::atomic<uint32_t> next_conn_id{0};
+
+    // request capture, see trace.h
+    int capture_fd = -1;
+    std::string capture_buf; // records not written out yet
+    uint64_t capture_start_ns = 0;
+    uint64_t capture_flush_ns = 0; // when capture_buf was last written
+
+    MemScan memscan;
+} data;
+
+// maps fds to connections. with --threads every loop has its own.
+static thread_local std::vector<Conn *> fd_to_conn;
+
+// server settings, filled in from the command line
+static struct {
+    HashObjLimits hash_limits;
+    // string values at least this big get compressed, 0 turns it off
+    size_t compress_min_size = 1024;
+    // compressed values are only kept if they save this percentage
+    size_t compress_min_saving = 20;
+    // keep data.index up to date for prefix and range scans
+    bool ordered_index = false;
+    // size of the client side caching table, see tracking.h
+    size_t tracking_slots = 1 << 14;
+    size_t tracking_max_entries = 1 << 20;
+    // event loops sharing the listeners, more than 1 serves a read mostly
+    // string keyspace from data.shared
+    size_t threads = 1;
+    // also listen on this unix socket, for clients on the same host
+    std::string unix_path;
+    // write every request to this trace file
+    std::string capture_path;
+    // tiered storage is on when this is set, values go in segments there
+    std::string tier_dir;
+    // strings not read or written for this long get spilled
+    uint64_t tier_cold_ms = 60 * 1000;
+    // smaller values stay in memory, the entry costs more than they save
+    size_t tier_min_size = 256;
+    size_t tier_io_threads = 2;
+    uint64_t tier_segment_size = 64 << 20;
+    // segments with less than this percentage of live bytes get compacted
+    uint32_t tier_compact_live_pct = 50;
+} config;
+
+// counters reported by the info command
+static struct {
+    uint64_t compress_attempts = 0;
+    uint64_t compress_kept = 0;
+    uint64_t compress_in_bytes = 0; // raw bytes of the kept values
+    uint64_t compress_out_bytes = 0; // compressed bytes of the kept values
+    uint64_t compress_cpu_ns = 0;
+    uint64_t decompress_ops = 0;
+    uint64_t decompress_cpu_ns = 0;
+    uint64_t decompress_errors = 0; // stored values that failed to decompress
+    uint64_t tier_spills = 0;
+    uint64_t tier_reads = 0;
+    uint64_t tier_compact_moves = 0;
+    uint64_t tier_io_errors = 0;
+    uint64_t tracking_fallbacks = 0; // clients moved to broadcast at the cap
+} stats;
+
+static uint64_t cpu_time_ns() {
+    struct timespec ts;
+    clock_gettime(CLOCK_THREAD_CPUTIME_ID, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000 + (uint64_t)ts.tv_nsec;
+}
+
+static uint64_t monotonic_ns() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000 + (uint64_t)ts.tv_nsec;
+}
+
+static uint64_t monotonic_ms() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC_COARSE, &ts);
+    return (uint64_t)ts.tv_sec * 1000 + (uint64_t)ts.tv_nsec / 1000000;
+}
+
+// cap on the bytes handed to the I/O pool for writing, so a burst of cold
+// values doesn't pile up copies of them in memory
+const size_t TIER_MAX_INFLIGHT = 8 << 20;
+
+// how long compaction leaves a segment alone after a failed copy, doubled
+// for every further failure up to the max
+const uint64_t TIER_COMPACT_BACKOFF_MS = 1000;
+const uint64_t TIER_COMPACT_BACKOFF_MAX_MS = 60000;
+
+static bool tier_on() {
+    return !config.tier_dir.empty();
+}
+
+static size_t entry_record_size(Entry *entry) {
+    return vlog_record_size(entry->key.size(), entry->cold_len);
+}
+
+// marks a use of the entry's value. a hot string becomes the most recently
+// used one, or leaves the spill list if it's too small to be worth it.
+static void tier_touch(Entry *entry) {
+    if (!tier_on() || entry->tier != TIER_HOT) {
+        return;
+    }
+    dlist_detach(&entry->tier_node);
+    entry->spill_id = 0; // a spill in flight is for a value that isn't cold
+    if (entry->type == T_STR && entry->value.size() >= config.tier_min_size) {
+        entry->last_access = monotonic_ms();
+        dlist_insert_before(&data.lru, &entry->tier_node);
+    }
+}
+
+// the entry's value is about to be replaced or freed. a cold value leaves
+// a dead record behind in its segment.
+static void tier_drop(Entry *entry) {
+    dlist_detach(&entry->tier_node);
+    entry->spill_id = 0;
+    if (entry->tier != TIER_COLD) {
+        return;
+    }
+    ValueSegment *seg = entry->cold_seg;
+    vlog_del_live(&data.vlog, seg, entry_record_size(entry));
+    entry->tier = TIER_HOT;
+    entry->cold_seg = NULL;
+    entry->cold_off = 0;
+    entry->cold_len = 0;
+    vlog_try_drop(&data.vlog, seg);
+}
+
+// frees whatever value the entry holds and turns it back into a string
+static void entry_clear_value(Entry *entry) {
+    tier_drop(entry);
+    if (entry->hash) {
+        hobj_destroy(entry->hash);
+        delete entry->hash;
+        entry->hash = NULL;
+    }
+    if (entry->list) {
+        ql_destroy(entry->list);
+        delete entry->list;
+        entry->list = NULL;
+    }
+    if (entry->hll) {
+        hll_destroy(entry->hll);
+        delete entry->hll;
+        entry->hll = NULL;
+    }
+    std::string().swap(entry->value);
+    entry->type = T_STR;
+    entry->encoding = ENC_RAW;
+    entry->raw_len = 0;
+}
+
+static void entry_destroy(Entry *entry) {
+    entry_clear_value(entry);
+    delete entry;
+}
+
+// adds a new entry to the keyspace
+static void db_insert(Entry *entry, uint64_t hashcode) {
+    data.db.put(entry, hashcode);
+    if (config.ordered_index) {
+        data.index.insert(entry);
+    }
+}
+
+// unlinks the entry stored under key from the keyspace, NULL if missing
+static Entry *db_remove(std::string_view key) {
+    Entry *entry = data.db.del(key);
+    if (entry && config.ordered_index) {
+        data.index.erase(entry);
+    }
+    return entry;
+}
+
+// queues a push message on a connection without waiting for a request.
+// a client that can't keep up with its invalidations gets disconnected,
+// since dropping one would leave it serving stale values.
+static void push_msg(uint32_t fd, const std::string &msg) {
+    Conn *conn = fd < fd_to_conn.size() ? fd_to_conn[fd] : NULL;
+    if (!conn || conn->state == STATE_END) {
+        return;
+    }
+
+    // while idle the client may still send a request, keep room for its reply
+    size_t cap = sizeof(conn->write_buf);
+    if (conn->state == STATE_REQ || conn->state == STATE_WAIT) {
+        cap -= 4 + MAX_MSG_SIZE;
+    }
+    if (conn->write_buf_size + 4 + msg.size() > cap) {
+        conn->state = STATE_END;
+        return;
+    }
+
+    uint32_t len = (uint32_t) msg.size();
+    memcpy(&conn->write_buf[conn->write_buf_size], &len, 4);
+    memcpy(&conn->write_buf[conn->write_buf_size + 4], msg.data(), msg.size());
+    conn->write_buf_size += 4 + msg.size();
+    if (conn->state != STATE_WAIT) {
+        conn->state = STATE_RES; // gets flushed once the fd is writable
+    } // else it goes out ahead of the reply
+}
+
+static void push_invalidate_slot(const std::vector<uint32_t> &fds, uint32_t slot) {
+    std::string msg;
+    msg.push_back(SER_PUSH);
+    msg.push_back(PUSH_INVALIDATE_SLOT);
+    msg.append((char *)&slot, 4);
+    for (uint32_t fd : fds) {
+        push_msg(fd, msg);
+    }
+}
+
+// tells clients caching key that it changed
+static void signal_modified(std::string_view key, uint64_t hashcode) {
+    if (tracking_idle(&data.tracking)) {
+        return;
+    }
+
+    std::vector<uint32_t> fds;
+    uint32_t slot = tracking_slot(&data.tracking, hashcode);
+    tracking_take_slot(&data.tracking, slot, &fds);
+    push_invalidate_slot(fds, slot);
+
+    fds.clear();
+    tracking_match_prefixes(&data.tracking, key, &fds);
+    if (fds.empty()) {
+        return;
+    }
+    std::string msg;
+    msg.push_back(SER_PUSH);
+    msg.push_back(PUSH_INVALIDATE_KEY);
+    uint32_t len = (uint32_t) key.size();
+    msg.append((char *)&len, 4);
+    msg.append(key.data(), key.size());
+    for (uint32_t fd : fds) {
+        push_msg(fd, msg);
+    }
+}
+
+// records that conn read the key so it can be told when it changes
+static void track_read(Conn *conn, std::string_view key, uint64_t hashcode) {
+    if (conn->tracking == TRACK_FALLBACK) {
+        // the part up to the first ':', else the key itself
+        size_t pos = key.find(':');
+        std::string_view prefix = pos == std::string_view::npos ? key : key.substr(0, pos + 1);
+        tracking_add_fallback_prefix(&data.tracking, conn->fd, prefix);
+        return;
+    }
+    if (conn->tracking != TRACK_SLOTS) {
+        return;
+    }
+
+    uint32_t slot = tracking_slot(&data.tracking, hashcode);
+    uint32_t fallback_fd = 0;
+    if (!tracking_remember(&data.tracking, conn->fd, slot, &fallback_fd)) {
+        return;
+    }
+    // over the cap, so the biggest tracker switches to broadcast
+    Conn *victim = fallback_fd < fd_to_conn.size() ? fd_to_conn[fallback_fd] : NULL;
+    if (victim) {
+        victim->tracking = TRACK_FALLBACK;
+    }
+    stats.tracking_fallbacks++;
+    std::string msg;
+    msg.push_back(SER_PUSH);
+    msg.push_back(PUSH_TRACKING_FALLBACK);
+    push_msg(fallback_fd, msg);
+    if (fallback_fd == (uint32_t) conn->fd) {
+        track_read(conn, key, hashcode);
+    }
+}
+
+static void output_wrong_type(std::string &out) {
+    output_err(out, ERR_TYPE, "Operation against a key holding the wrong kind of value");
+}
+
+// stores val as the entry's string value, compressed if that pays off
+static void entry_set_str(Entry *entry, std::string &val) {
+    entry->encoding = ENC_RAW;
+    entry->raw_len = 0;
+    size_t raw_len = val.size();
+    if (!config.compress_min_size || raw_len < config.compress_min_size) {
+        entry->value.swap(val);
+        return;
+    }
+
+    // give the codec just enough room to hit the required saving
+    uint64_t start = cpu_time_ns();
+    size_t max_len = raw_len - raw_len * config.compress_min_saving / 100;
+    std::string packed(max_len, '\0');
+    size_t packed_len = lzf_compress(
+        (const uint8_t *)val.data(), raw_len, (uint8_t *)&packed[0], max_len);
+    stats.compress_attempts++;
+    stats.compress_cpu_ns += cpu_time_ns() - start;
+
+    if (!packed_len) {
+        entry->value.swap(val);
+        return;
+    }
+    packed.resize(packed_len);
+    packed.shrink_to_fit();
+    entry->value.swap(packed);
+    entry->encoding = ENC_LZF;
+    entry->raw_len = (uint32_t) raw_len;
+    stats.compress_kept++;
+    stats.compress_in_bytes += raw_len;
+    stats.compress_out_bytes += packed_len;
+}
+
+// points val at the raw bytes of a stored string value, using buf if it
+// needs decompressing. returns false if a compressed value doesn't
+// decompress to exactly raw_len bytes.
+static bool str_decode(
+        std::string_view stored,
+        uint32_t encoding,
+        uint32_t raw_len,
+        std::string &buf,
+        std::string_view *val
+    ) {
+    if (encoding == ENC_RAW) {
+        *val = stored;
+        return true;
+    }
+
+    uint64_t start = cpu_time_ns();
+    buf.resize(raw_len);
+    size_t len = lzf_decompress(
+        (const uint8_t *)stored.data(), stored.size(),
+        (uint8_t *)&buf[0], buf.size());
+    stats.decompress_ops++;
+    stats.decompress_cpu_ns += cpu_time_ns() - start;
+    if (len != raw_len) {
+        stats.decompress_errors++;
+        return false;
+    }
+    *val = buf;
+    return true;
+}
+
+// returns the raw string value of a hot entry
+static bool entry_get_str(Entry *entry, std::string &buf, std::string_view *val) {
+    return str_decode(entry->value, entry->encoding, entry->raw_len, buf, val);
+}
+
+static void output_corrupt(std::string &out) {
+    output_err(out, ERR_UNKNOWN, "Stored value is corrupt");
+}
+
+// work handed to the I/O pool for tiered storage
+enum {
+    TIER_SPILL = 0, // write a cold value to the log
+    TIER_READ = 1, // read one back for a GET
+    TIER_MOVE = 2 // copy a live record out of a segment being compacted
+};
+
+struct TierTask {
+    IoTask io;
+    uint32_t kind = TIER_SPILL;
+    std::string key;
+    ValueSegment *seg = NULL; // where the record is or goes
+    uint64_t off = 0;
+    uint64_t spill_id = 0; // TIER_SPILL
+    Conn *conn = NULL; // TIER_READ
+    uint32_t encoding = ENC_RAW; // TIER_READ
+    uint32_t raw_len = 0; // TIER_READ
+    ValueSegment *dst = NULL; // TIER_MOVE
+    uint64_t dst_off = 0; // TIER_MOVE
+};
+
+// segments stay open while tasks use them
+static void tier_submit(TierTask *t) {
+    t->io.arg = t;
+    t->seg->pending_io++;
+    if (t->dst) {
+        t->dst->pending_io++;
+    }
+    iopool_submit(&data.io, &t->io);
+}
+
+// starts reading a cold value back. the conn waits, sending nothing and
+// reading no further requests, until the reply is ready.
+static void tier_read(Conn *conn, Entry *entry) {
+    TierTask *t = new TierTask();
+    t->kind = TIER_READ;
+    t->key = entry->key;
+    t->seg = entry->cold_seg;
+    t->off = entry->cold_off;
+    t->conn = conn;
+    t->encoding = entry->encoding;
+    t->raw_len = entry->raw_len;
+    t->io.op = IO_READ;
+    t->io.fd = t->seg->fd;
+    t->io.offset = t->off + VLOG_HEADER_SIZE + entry->key.size();
+    t->io.len = entry->cold_len;
+
+    conn->state = STATE_WAIT;
+    conn->io_pending = true;
+    stats.tier_reads++;
+    tier_submit(t);
+}
+
+// writes out strings that haven't been used for tier_cold_ms, oldest first
+static void tier_spill_some() {
+    uint64_t now = monotonic_ms();
+    while (!dlist_empty(&data.lru) && data.tier_write_bytes < TIER_MAX_INFLIGHT) {
+        Entry *entry = dlist_item<Entry, &Entry::tier_node>(data.lru.next);
+        if (now - entry->last_access < config.tier_cold_ms) {
+            break;
+        }
+
+        TierTask *t = new TierTask();
+        t->kind = TIER_SPILL;
+        t->key = entry->key;
+        vlog_record(entry->key, entry->value, &t->io.buf);
+        if (vlog_reserve(&data.vlog, t->io.buf.size(), &t->seg, &t->off)) {
+            stats.tier_io_errors++;
+            delete t;
+            tier_touch(entry); // try again once it's cold again
+            break;
+        }
+        t->spill_id = ++data.spill_seq;
+        t->io.op = IO_WRITE;
+        t->io.fd = t->seg->fd;
+        t->io.offset = t->off;
+
+        // it stays hot, and off the list, until the write is done
+        dlist_detach(&entry->tier_node);
+        entry->spill_id = t->spill_id;
+        data.tier_write_bytes += t->io.buf.size();
+        tier_submit(t);
+    }
+}
+
+// copies the live records of the emptiest segment to the end of the log, a
+// batch per call. once none are left the segment gets unlinked.
+static void tier_compact_some() {
+    ValueSegment *victim = vlog_pick_victim(&data.vlog, config.tier_compact_live_pct, monotonic_ms());
+    if (!victim) {
+        return;
+    }
+    while (!dlist_empty(&victim->records) && data.tier_write_bytes < TIER_MAX_INFLIGHT) {
+        Entry *entry = dlist_item<Entry, &Entry::tier_node>(victim->records.next);
+        size_t len = entry_record_size(entry);
+
+        TierTask *t = new TierTask();
+        t->kind = TIER_MOVE;
+        t->key = entry->key;
+        t->seg = victim;
+        t->off = entry->cold_off;
+        if (vlog_reserve(&data.vlog, len, &t->dst, &t->dst_off)) {
+            stats.tier_io_errors++;
+            delete t;
+            return;
+        }
+        t->io.op = IO_COPY;
+        t->io.fd = victim->fd;
+        t->io.offset = t->off;
+        t->io.len = len;
+        t->io.dst_fd = t->dst->fd;
+        t->io.dst_offset = t->dst_off;
+
+        // off the list while moving, reads still go to the old record
+        dlist_detach(&entry->tier_node);
+        data.tier_write_bytes += len;
+        tier_submit(t);
+    }
+}
+
+// writes the GET reply for entry into out, or for a cold value starts
+// reading it and leaves the reply for later. tracking is registered along
+// with the reply, so the client hears of any change after the value it got.
+static void get_str(Conn *conn, Entry *entry, std::string &out) {
+    if (!entry) {
+        output_nil(out);
+        return;
+    }
+    if (entry->type != T_STR) {
+        output_wrong_type(out);
+        return;
+    }
+    if (entry->tier == TIER_COLD) {
+        tier_read(conn, entry);
+        return;
+    }
+
+    std::string buf;
+    std::string_view val;
+    if (!entry_get_str(entry, buf, &val)) {
+        output_corrupt(out);
+        return;
+    }
+    output_str(out, val);
+    tier_touch(entry);
+    track_read(conn, entry->key, entry->node.hashcode);
+}
+
+static void do_get(
+    Conn *conn,
+    std::vector<std::string> &cmd,
+    std::string &out
+) {
+    get_str(conn, data.db.get(cmd[1]), out);
+}
+
+static void do_set(
+    std::vector<std::string> &cmd,
+    std::string &out
+) {
+    uint64_t hashcode = EntryMap::hash(cmd[1]);
+    signal_modified(cmd[1], hashcode);
+    Entry *entry = data.db.get(cmd[1], hashcode);
+    if (entry) {
+        if (entry->type != T_STR) {
+            entry_clear_value(entry);
+        }
+        tier_drop(entry);
+        entry_set_str(entry, cmd[2]);
+    } else {
+        entry = new Entry();
+        entry->key.swap(cmd[1]);
+        entry_set_str(entry, cmd[2]);
+        db_insert(entry, hashcode);
+    }
+    tier_touch(entry);
+    output_nil(out);
+}
+
+static void do_del(
+    std::vector<std::string> &cmd,
+    std::string &out
+) {
+    Entry *deleted = db_remove(cmd[1]);
+    if (deleted) {
+        signal_modified(deleted->key, deleted->node.hashcode);
+        entry_destroy(deleted);
+    }
+    output_int(out, deleted ? 1 : 0);
+}
+
+static void do_keys(
+    std::vector<std::string> &cmd,
+    std::string &out
+) {
+    output_arr_size(out, (uint32_t)data.db.size());
+    data.db.foreach([&out](Entry *entry) {
+        output_str(out, entry->key);
+    });
+}
+
+// writes an error and returns false if the entry holds a different type.
+// a missing entry is fine, commands treat it as an empty value.
+static bool check_type(Entry *entry, uint32_t type, std::string &out) {
+    if (entry && entry->type != type) {
+        output_wrong_type(out);
+        return false;
+    }
+    return true;
+}
+
+static void do_hset(
+    std::vector<std::string> &cmd,
+    std::string &out
+) {
+    uint64_t hashcode = EntryMap::hash(cmd[1]);
+    Entry *entry = data.db.get(cmd[1], hashcode);
+    if (!check_type(entry, T_HASH, out)) {
+        return;
+    }
+    if (!entry) {
+        entry = new Entry();
+        entry->key.swap(cmd[1]);
+        entry->type = T_HASH;
+        entry->hash = new HashObj();
+        db_insert(entry, hashcode);
+    }
+
+    bool added = hobj_set(entry->hash, cmd[2], cmd[3], config.hash_limits);
+    output_int(out, added ? 1 : 0);
+}
+
+static void do_hget(
+    std::vector<std::string> &cmd,
+    std::string &out
+) {
+    Entry *entry = data.db.get(cmd[1]);
+    if (!check_type(entry, T_HASH, out)) {
+        return;
+    }
+
+    std::string_view val;
+    if (entry && hobj_get(entry->hash, cmd[2], &val)) {
+        output_str(out, val);
+    } else {
+        output_nil(out);
+    }
+}
+
+static void do_hdel(
+    std::vector<std::string> &cmd,
+    std::string &out
+) {
+    Entry *entry = data.db.get(cmd[1]);
+    if (!check_type(entry, T_HASH, out)) {
+        return;
+    }
+
+    bool deleted = entry && hobj_del(entry->hash, cmd[2]);
+    if (deleted && hobj_len(entry->hash) == 0) {
+        // drop the key along with its last field
+        entry_destroy(db_remove(cmd[1]));
+    }
+    output_int(out, deleted ? 1 : 0);
+}
+
+static void do_hgetall(
+    std::vector<std::string> &cmd,
+    std::string &out
+) {
+    Entry *entry = data.db.get(cmd[1]);
+    if (!check_type(entry, T_HASH, out)) {
+        return;
+    }
+    if (!entry) {
+        output_arr_size(out, 0);
+        return;
+    }
+
+    output_arr_size(out, (uint32_t)(hobj_len(entry->hash) * 2));
+    hobj_foreach(entry->hash, [&out](std::string_view field, std::string_view value) {
+        output_str(out, field);
+        output_str(out, value);
+    });
+}
+
+static void do_hlen(
+    std::vector<std::string> &cmd,
+    std::string &out
+) {
+    Entry *entry = data.db.get(cmd[1]);
+    if (!check_type(entry, T_HASH, out)) {
+        return;
+    }
+    output_int(out, entry ? (int64_t) hobj_len(entry->hash) : 0);
+}
+
+static bool str2int(const std::string &s, int64_t *out) {
+    char *endp = NULL;
+    errno = 0;
+    *out = strtoll(s.c_str(), &endp, 10);
+    return errno == 0 && !s.empty() && endp == s.c_str() + s.size();
+}
+
+// lpush and rpush, which push every value after the key in order
+static void do_push(
+    std::vector<std::string> &cmd,
+    std::string &out,
+    bool front
+) {
+    uint64_t hashcode = EntryMap::hash(cmd[1]);
+    Entry *entry = data.db.get(cmd[1], hashcode);
+    if (!check_type(entry, T_LIST, out)) {
+        return;
+    }
+    if (!entry) {
+        entry = new Entry();
+        entry->key.swap(cmd[1]);
+        entry->type = T_LIST;
+        entry->list = new QuickList();
+        db_insert(entry, hashcode);
+    }
+
+    for (size_t i = 2; i < cmd.size(); i++) {
+        if (front) {
+            ql_push_front(entry->list, cmd[i]);
+        } else {
+            ql_push_back(entry->list, cmd[i]);
+        }
+    }
+    output_int(out, (int64_t) ql_len(entry->list));
+}
+
+// lpop and rpop
+static void do_pop(
+    std::vector<std::string> &cmd,
+    std::string &out,
+    bool front
+) {
+    Entry *entry = data.db.get(cmd[1]);
+    if (!check_type(entry, T_LIST, out)) {
+        return;
+    }
+    if (!entry) {
+        output_nil(out);
+        return;
+    }
+
+    std::string val;
+    if (front) {
+        ql_pop_front(entry->list, &val);
+    } else {
+        ql_pop_back(entry->list, &val);
+    }
+    if (ql_len(entry->list) == 0) {
+        // drop the key along with its last element
+        entry_destroy(db_remove(cmd[1]));
+    }
+    output_str(out, val);
+}
+
+static void do_llen(
+    std::vector<std::string> &cmd,
+    std::string &out
+) {
+    Entry *entry = data.db.get(cmd[1]);
+    if (!check_type(entry, T_LIST, out)) {
+        return;
+    }
+    output_int(out, entry ? (int64_t) ql_len(entry->list) : 0);
+}
+
+static void do_lrange(
+    std::vector<std::string> &cmd,
+    std::string &out
+) {
+    int64_t start = 0;
+    int64_t stop = 0;
+    if (!str2int(cmd[2], &start) || !str2int(cmd[3], &stop)) {
+        output_err(out, ERR_ARG, "Expected integer range");
+        return;
+    }
+    Entry *entry = data.db.get(cmd[1]);
+    if (!check_type(entry, T_LIST, out)) {
+        return;
+    }
+
+    // negative indices count from the end, the range is inclusive
+    int64_t len = entry ? (int64_t) ql_len(entry->list) : 0;
+    if (start < 0) {
+        start += len;
+    }
+    if (stop < 0) {
+        stop += len;
+    }
+    start = start < 0 ? 0 : start;
+    stop = stop >= len ? len - 1 : stop;
+    if (start > stop) {
+        output_arr_size(out, 0);
+        return;
+    }
+
+    output_arr_size(out, (uint32_t)(stop - start + 1));
+    ql_foreach_range(entry->list, (size_t) start, (size_t)(stop - start + 1),
+        [&out](std::string_view val) {
+            output_str(out, val);
+        });
+}
+
+static void do_pfadd(
+    std::vector<std::string> &cmd,
+    std::string &out
+) {
+    uint64_t hashcode = EntryMap::hash(cmd[1]);
+    Entry *entry = data.db.get(cmd[1], hashcode);
+    if (!check_type(entry, T_HLL, out)) {
+        return;
+    }
+    bool changed = false;
+    if (!entry) {
+        entry = new Entry();
+        entry->key.swap(cmd[1]);
+        entry->type = T_HLL;
+        entry->hll = new HyperLogLog();
+        db_insert(entry, hashcode);
+        changed = true;
+    }
+
+    for (size_t i = 2; i < cmd.size(); i++) {
+        changed = hll_add(entry->hll, cmd[i]) || changed;
+    }
+    output_int(out, changed ? 1 : 0);
+}
+
+// max of the registers of every HLL named in cmd[first:], false on a type error
+static bool merge_hlls(
+    std::vector<std::string> &cmd,
+    size_t first,
+    HllRegisters *regs,
+    std::string &out
+) {
+    memset(regs->regs, 0, sizeof(regs->regs));
+    for (size_t i = first; i < cmd.size(); i++) {
+        Entry *entry = data.db.get(cmd[i]);
+        if (!check_type(entry, T_HLL, out)) {
+            return false;
+        }
+        if (entry) {
+            hll_merge_into(regs, entry->hll);
+        }
+    }
+    return true;
+}
+
+static void do_pfcount(
+    std::vector<std::string> &cmd,
+    std::string &out
+) {
+    if (cmd.size() == 2) {
+        Entry *entry = data.db.get(cmd[1]);
+        if (check_type(entry, T_HLL, out)) {
+            output_int(out, entry ? (int64_t) hll_count(entry->hll) : 0);
+        }
+        return;
+    }
+
+    // count of the union, without storing it anywhere
+    HllRegisters regs;
+    if (merge_hlls(cmd, 1, &regs, out)) {
+        output_int(out, (int64_t) hll_estimate(&regs));
+    }
+}
+
+static void do_pfmerge(
+    std::vector<std::string> &cmd,
+    std::string &out
+) {
+    uint64_t hashcode = EntryMap::hash(cmd[1]);
+    Entry *dest = data.db.get(cmd[1], hashcode);
+    if (!check_type(dest, T_HLL, out)) {
+        return;
+    }
+
+    // the destination's own registers are part of the union
+    HllRegisters regs;
+    if (!merge_hlls(cmd, 1, &regs, out)) {
+        return;
+    }
+    if (!dest) {
+        dest = new Entry();
+        dest->key = cmd[1];
+        dest->type = T_HLL;
+        dest->hll = new HyperLogLog();
+        db_insert(dest, hashcode);
+    }
+    hll_store(dest->hll, &regs);
+    output_nil(out);
+}
+
+// writes up to limit keys, starting from the first key >= start, for as
+// long as in_range accepts them
+template <typename F>
+static void scan_index(
+    std::string_view start,
+    int64_t limit,
+    F &&in_range,
+    std::string &out
+) {
+    std::vector<Entry *> found;
+    Entry *entry = data.index.lower_bound(start);
+    while (entry && (int64_t) found.size() < limit && in_range(entry->key)) {
+        found.push_back(entry);
+        entry = data.index.next(entry);
+    }
+
+    output_arr_size(out, (uint32_t) found.size());
+    for (Entry *e : found) {
+        output_str(out, e->key);
+    }
+}
+
+static bool check_index(std::string &out) {
+    if (!config.ordered_index) {
+        output_err(out, ERR_ARG, "Ordered index is off, start the server with --ordered-index");
+        return false;
+    }
+    return true;
+}
+
+// keyprefix prefix limit
+static void do_keyprefix(
+    std::vector<std::string> &cmd,
+    std::string &out
+) {
+    int64_t limit = 0;
+    if (!str2int(cmd[2], &limit)) {
+        output_err(out, ERR_ARG, "Expected integer limit");
+        return;
+    }
+    if (!check_index(out)) {
+        return;
+    }
+
+    std::string_view prefix = cmd[1];
+    scan_index(prefix, limit, [prefix](std::string_view key) {
+        return key.substr(0, prefix.size()) == prefix;
+    }, out);
+}
+
+// keyrange start end limit, start is inclusive and end exclusive.
+// an empty end means no upper bound.
+static void do_keyrange(
+    std::vector<std::string> &cmd,
+    std::string &out
+) {
+    int64_t limit = 0;
+    if (!str2int(cmd[3], &limit)) {
+        output_err(out, ERR_ARG, "Expected integer limit");
+        return;
+    }
+    if (!check_index(out)) {
+        return;
+    }
+
+    std::string_view end = cmd[2];
+    scan_index(cmd[1], limit, [end](std::string_view key) {
+        return end.empty() || key < end;
+    }, out);
+}
 
-    errno = 0;
-    fcntl(fd, F_SETFL, flags);
-    if (errno) {
-        die("fcntl error");
+// client tracking on [bcast [prefix...]]
+// client tracking off
+static void do_client_tracking(
+    Conn *conn,
+    std::vector<std::string> &cmd,
+    std::string &out
+) {
+    bool on = strcasecmp(cmd[2].c_str(), "on") == 0;
+    bool bcast = cmd.size() > 3 && strcasecmp(cmd[3].c_str(), "bcast") == 0;
+    if ((!on && strcasecmp(cmd[2].c_str(), "off") != 0)
+            || (!on && cmd.size() > 3)
+            || (on && cmd.size() > 3 && !bcast)) {
+        output_err(out, ERR_ARG, "Expected client tracking on [bcast [prefix...]] or off");
         return;
     }
-}
-
-static bool try_flush_buffer(Conn *conn) {
-    ssize_t res = 0;
-    do {
-        size_t remaining_bytes = conn->write_buf_size - conn->write_buf_sent;
-        res = write(conn->fd, &conn->write_buf[conn->write_buf_sent], remaining_bytes);
-    } while (res < 0 && errno == EINTR);
 
-    if (res < 0 && errno == EAGAIN) {
-        return false;
+    // start from a clean slate, the client drops its cache on any change
+    tracking_forget(&data.tracking, conn->fd);
+    conn->tracking = TRACK_OFF;
+    if (!on) {
+        output_nil(out);
+        return;
     }
 
-    if (res < 0) {
-        printf("write() error");
-        conn->state = STATE_END;
-        return false;
+    if (bcast) {
+        conn->tracking = TRACK_BCAST;
+        for (size_t i = 4; i < cmd.size(); i++) {
+            tracking_add_prefix(&data.tracking, conn->fd, cmd[i]);
+        }
+        if (cmd.size() == 4) {
+            tracking_add_prefix(&data.tracking, conn->fd, ""); // every key
+        }
+    } else {
+        conn->tracking = TRACK_SLOTS;
     }
+    // the client needs the slot count to map slot invalidations to keys
+    output_int(out, (int64_t)(data.tracking.mask + 1));
+}
 
-    conn->write_buf_sent += (size_t) res;
-    if (conn->write_buf_sent == conn->write_buf_size) {
-        // change state back since msg has been fully sent
-        conn->state = STATE_REQ;
-        conn->write_buf_sent = 0;
-        conn->write_buf_size = 0;
-        return false;
-    }
+static void output_stat(std::string &out, const char *name, uint64_t val) {
+    char buf[128];
+    snprintf(buf, sizeof(buf), "%s:%lu", name, val);
+    output_str(out, buf);
+}
 
-    // try write again
-    return true;
+static void output_stat(std::string &out, const char *name, double val) {
+    char buf[128];
+    snprintf(buf, sizeof(buf), "%s:%.2f", name, val);
+    output_str(out, buf);
 }
 
-static void handle_state_res(Conn *conn) {
-    while (try_flush_buffer(conn)) {}
+static void do_info(std::string &out) {
+    uint64_t kept = stats.compress_kept;
+    uint64_t attempts = stats.compress_attempts;
+    uint64_t decompressed = stats.decompress_ops;
+
+    output_arr_size(out, 15);
+    output_stat(out, "compress_attempts", attempts);
+    output_stat(out, "compress_kept", kept);
+    output_stat(out, "compress_ratio", stats.compress_out_bytes
+        ? (double) stats.compress_in_bytes / (double) stats.compress_out_bytes
+        : 0.0);
+    output_stat(out, "compress_cpu_ns_per_op", attempts
+        ? (double) stats.compress_cpu_ns / (double) attempts
+        : 0.0);
+    output_stat(out, "decompress_ops", decompressed);
+    output_stat(out, "decompress_cpu_ns_per_op", decompressed
+        ? (double) stats.decompress_cpu_ns / (double) decompressed
+        : 0.0);
+    output_stat(out, "decompress_errors", stats.decompress_errors);
+    output_stat(out, "tier_spills", stats.tier_spills);
+    output_stat(out, "tier_reads", stats.tier_reads);
+    output_stat(out, "tier_compact_moves", stats.tier_compact_moves);
+    output_stat(out, "tier_io_errors", stats.tier_io_errors);
+    output_stat(out, "tracking_fallbacks", stats.tracking_fallbacks);
+    output_stat(out, "tier_segments", (uint64_t) data.vlog.segments.size());
+    output_stat(out, "tier_disk_bytes", data.vlog.disk_bytes);
+    output_stat(out, "tier_live_bytes", data.vlog.live_bytes);
 }
 
-enum {
-    RES_OK = 0,
-    RES_ERR = 1,
-    RES_NX = 2
-};
+// fields or chunks looked at to estimate a big hash or list
+const size_t MEMORY_SAMPLES = 8;
 
-static struct {
-    HashMap db;
-} data;
+// buckets plus keys a scan step visits per loop iteration
+const size_t MEMSCAN_STEP_WORK = 1024;
 
-struct Entry {
-    struct HashTableNode node;
-    std::string key;
-    std::string value;
-};
+// distinct prefixes a pass keeps apart, keys under any others are lumped
+// together as "(other)"
+const size_t MEMSCAN_MAX_PREFIXES = 1024;
 
-static bool entry_eq(HashTableNode *node1, HashTableNode *node2) {
-    // convert from nodes to entries
-    struct Entry *entry1 = container_of(node1, struct Entry, node);
-    struct Entry *entry2 = container_of(node2, struct Entry, node);
+// prefixes MEMORY TOP lists when not told
+const size_t MEMORY_TOP_DEFAULT = 10;
 
-    return node1->hashcode == node2->hashcode && entry1->key == entry2->key;
-};
+static uint64_t entry_value_bytes(Entry *entry, size_t samples) {
+    if (entry->type == T_HASH) {
+        return hobj_mem_usage(entry->hash, samples);
+    } else if (entry->type == T_LIST) {
+        return ql_mem_usage(entry->list, samples);
+    } else if (entry->type == T_HLL) {
+        return hll_mem_usage(entry->hll);
+    }
+    return string_heap_bytes(entry->value); // 0 for cold strings
+}
+
+// what keys are grouped by in the report, up to and including the first
+// ':'. empty for keys without one.
+static std::string_view key_prefix(std::string_view key) {
+    size_t pos = key.find(':');
+    return pos == std::string_view::npos ? std::string_view() : key.substr(0, pos + 1);
+}
 
-static uint64_t hash_string(const uint8_t *data, size_t len) {
-    uint32_t hash = 0x811C9DC5;
-    for (size_t i = 0; i < len; i++) {
-        hash = (hash + data[i]) * 0x01000193;
+static void memscan_add(Entry *entry) {
+    MemScan &scan = data.memscan;
+    uint64_t key_bytes = string_heap_bytes(entry->key);
+    uint64_t value_bytes = entry_value_bytes(entry, MEMORY_SAMPLES);
+    uint64_t bytes = sizeof(Entry) + key_bytes + value_bytes;
+    scan.totals.keys++;
+    scan.totals.entry_bytes += sizeof(Entry);
+    scan.totals.key_bytes += key_bytes;
+    scan.totals.value_bytes += value_bytes;
+
+    std::string_view prefix = key_prefix(entry->key);
+    PrefixStat *stat = scan.prefixes.get(prefix);
+    if (!stat && scan.prefixes.size() >= MEMSCAN_MAX_PREFIXES) {
+        prefix = "(other)"; // can't clash, real prefixes end in ':'
+        stat = scan.prefixes.get(prefix);
+    }
+    if (!stat) {
+        stat = new PrefixStat();
+        stat->prefix = prefix;
+        scan.prefixes.put(stat, stat->prefix);
+    }
+    stat->keys++;
+    stat->bytes += bytes;
+    if (bytes > stat->largest_bytes) {
+        stat->largest_key = entry->key;
+        stat->largest_bytes = bytes;
     }
-    return hash;
 }
 
-static void do_get(
+static void memscan_start() {
+    MemScan &scan = data.memscan;
+    if (scan.running) {
+        return;
+    }
+    scan.running = true;
+    scan.table = NULL;
+    scan.mask = 0;
+    scan.pos = 0;
+    scan.totals = MemTotals{};
+}
+
+// throws away what the pass counted so far and walks the current ht1 from
+// its first bucket
+static void memscan_restart() {
+    MemScan &scan = data.memscan;
+    scan.prefixes.foreach([](PrefixStat *stat) { delete stat; });
+    scan.prefixes.destroy();
+    scan.table = data.db.hm.ht1.table;
+    scan.mask = data.db.hm.ht1.mask;
+    scan.pos = 0;
+    scan.totals = MemTotals{};
+}
+
+static void memscan_finish() {
+    MemScan &scan = data.memscan;
+    scan.top.clear();
+    scan.prefixes.foreach([&scan](PrefixStat *stat) {
+        scan.top.push_back(std::move(*stat));
+        delete stat;
+    });
+    scan.prefixes.destroy();
+    std::sort(scan.top.begin(), scan.top.end(), [](const PrefixStat &a, const PrefixStat &b) {
+        return a.bytes > b.bytes;
+    });
+    scan.last = scan.totals;
+    scan.done = true;
+    scan.done_ms = monotonic_ms();
+    scan.running = false;
+}
+
+// moves the pass on by a bounded amount of work. only the bucket position
+// is kept between steps, so keys can change freely in between. a resize
+// would move keys past the position, so the pass first finishes any resize
+// in progress, then walks ht1 alone, and starts over if another resize
+// replaced ht1 since the last step. that way every key is counted once.
+static void memscan_step() {
+    MemScan &scan = data.memscan;
+    HashMap *hm = &data.db.hm;
+    size_t work = 0;
+    while (work < MEMSCAN_STEP_WORK) {
+        if (hm->ht2.table) {
+            hm_move_batch(hm);
+            work += RESIZE_BATCH_SIZE;
+            continue;
+        }
+        if (hm->ht1.table != scan.table || hm->ht1.mask != scan.mask) {
+            memscan_restart();
+        }
+        if (!scan.table || scan.pos > scan.mask) {
+            memscan_finish();
+            return;
+        }
+        for (HashTableNode *node = scan.table[scan.pos]; node; node = node->next) {
+            memscan_add(EntryMap::from_node(node));
+            work++;
+        }
+        scan.pos++;
+        work++;
+    }
+}
+
+// memory usage key [samples N]. what the key costs, entry included. big
+// hashes and lists are estimated from N fields or chunks, 0 counts all.
+static void do_memory_usage(
     std::vector<std::string> &cmd,
     std::string &out
 ) {
-    Entry entry;
-    entry.key.swap(cmd[1]);
-    entry.node.hashcode = hash_string((uint8_t *)entry.key.data(), entry.key.size());
-
-    HashTableNode *node = hm_get(&data.db, &entry.node, &entry_eq);
-    if (!node) {
+    int64_t samples = MEMORY_SAMPLES;
+    if (cmd.size() == 5 && (strcasecmp(cmd[3].c_str(), "samples") != 0
+            || !str2int(cmd[4], &samples) || samples < 0)) {
+        output_err(out, ERR_ARG, "Expected samples count");
+        return;
+    }
+    Entry *entry = data.db.get(cmd[2]);
+    if (!entry) {
         output_nil(out);
         return;
     }
+    output_int(out, (int64_t)(sizeof(Entry) + string_heap_bytes(entry->key)
+        + entry_value_bytes(entry, (size_t) samples)));
+}
 
-    const std::string &val = container_of(node, Entry, node)->value; 
-    output_str(out, val);
+// memory stats. hash table and connection figures are current, the rest
+// come from the last pass over the keyspace, which this starts over.
+static void do_memory_stats(std::string &out) {
+    MemScan &scan = data.memscan;
+    uint64_t conns = 0;
+    for (Conn *conn : fd_to_conn) {
+        conns += conn ? 1 : 0;
+    }
+    uint64_t age_ms = scan.done ? monotonic_ms() - scan.done_ms : 0;
+    memscan_start();
+
+    output_arr_size(out, 10);
+    output_stat(out, "hashtable_bytes", (uint64_t) hm_bucket_bytes(&data.db.hm));
+    output_stat(out, "entry_bytes", scan.last.entry_bytes);
+    output_stat(out, "key_bytes", scan.last.key_bytes);
+    output_stat(out, "value_bytes", scan.last.value_bytes);
+    output_stat(out, "conn_buffer_bytes", conns * sizeof(Conn));
+    output_stat(out, "conns", conns);
+    output_stat(out, "keys", (uint64_t) data.db.size());
+    output_stat(out, "scan_keys", scan.last.keys);
+    output_stat(out, "scan_done", (uint64_t) scan.done);
+    output_stat(out, "scan_age_ms", age_ms);
 }
 
-static void do_set(
+// memory top [N]. the N prefixes using the most memory as of the last pass,
+// with their key count and biggest key. starts a new pass, like stats.
+static void do_memory_top(
     std::vector<std::string> &cmd,
     std::string &out
 ) {
-    Entry entry;
-    entry.key.swap(cmd[1]);
-    entry.node.hashcode = hash_string((uint8_t *)entry.key.data(), entry.key.size());
-    
-    HashTableNode *node = hm_get(&data.db, &entry.node, &entry_eq);
-    if (node) {
-        container_of(node, Entry, node)->value.swap(cmd[2]);
-    } else {
-        Entry *newEntry = new Entry();
-        newEntry->key.swap(entry.key);
-        newEntry->node.hashcode = entry.node.hashcode;
-        newEntry->value.swap(cmd[2]);
-        hm_put(&data.db, &newEntry->node);
+    int64_t limit = MEMORY_TOP_DEFAULT;
+    if (cmd.size() == 3 && (!str2int(cmd[2], &limit) || limit < 0)) {
+        output_err(out, ERR_ARG, "Expected integer limit");
+        return;
+    }
+    MemScan &scan = data.memscan;
+    memscan_start();
+
+    size_t n = std::min((size_t) limit, scan.top.size());
+    output_arr_size(out, (uint32_t) n);
+    for (size_t i = 0; i < n; i++) {
+        const PrefixStat &stat = scan.top[i];
+        char buf[128];
+        snprintf(buf, sizeof(buf), " keys:%lu bytes:%lu largest:%lu ",
+            stat.keys, stat.bytes, stat.largest_bytes);
+        output_str(out, (stat.prefix.empty() ? "(none)" : stat.prefix) + buf + stat.largest_key);
     }
-    output_nil(out);
 }
 
-static void do_del(
+static void do_hello(
+    Conn *conn,
     std::vector<std::string> &cmd,
     std::string &out
 ) {
-    Entry entry;
-    entry.key.swap(cmd[1]);
-    entry.node.hashcode = hash_string((uint8_t *)entry.key.data(), entry.key.size());
-
-    HashTableNode *deletedNode = hm_del(&data.db, &entry.node, &entry_eq);
-    if (deletedNode) {
-        delete container_of(deletedNode, Entry, node);
-    }
-    output_int(out, deletedNode ? 1 : 0);
-}
-
-// applies funct to each node in a given hashtable
-static void ht_foreach(HashTable *ht, void (*funct)(HashTableNode *, void *), void *arg) {
-    if (ht->size == 0) {
+    uint32_t version = (uint32_t) strtoul(cmd[1].c_str(), NULL, 10);
+    if (version != PROTO_V1 && version != PROTO_V2) {
+        output_err(out, ERR_ARG, "Unsupported protocol version");
         return;
     }
+    // takes effect from the next request, which may already be buffered
+    conn->proto = version;
+    output_int(out, version);
+}
 
-    for (size_t i = 0; i < ht->mask + 1; ++i) {
-        HashTableNode *node = ht->table[i];
-        while (node) {
-            funct(node, arg);
-            node = node->next;
-        }
+// the commands --threads loops serve. they only see data.shared, which
+// holds plain uncompressed strings.
+static void do_shared_get(
+    std::vector<std::string> &cmd,
+    std::string &out
+) {
+    EpochGuard guard;
+    SharedEntry *entry = data.shared.get(cmd[1]);
+    if (entry) {
+        output_str(out, entry->value);
+    } else {
+        output_nil(out);
     }
 }
 
-static void extract_key(HashTableNode *node, void *arg) {
-    // nasty cast to string
-    std::string &out = *(std::string *) arg;
-
-    // write key to arg
-    output_str(out, container_of(node, Entry, node)->key);
+static void do_shared_set(
+    std::vector<std::string> &cmd,
+    std::string &out
+) {
+    SharedEntry *entry = new SharedEntry();
+    entry->key.swap(cmd[1]);
+    entry->value.swap(cmd[2]);
+    SharedEntry *old = data.shared.put(entry, entry->key);
+    if (old) {
+        SharedMap::retire(old);
+    }
+    output_nil(out);
 }
 
-static void do_keys(
+static void do_shared_del(
     std::vector<std::string> &cmd,
     std::string &out
 ) {
-    output_arr_size(out, (uint32_t)hm_size(&data.db));
-    ht_foreach(&data.db.ht1, &extract_key, &out);
-    ht_foreach(&data.db.ht2, &extract_key, &out);
+    SharedEntry *old = data.shared.del(cmd[1]);
+    if (old) {
+        SharedMap::retire(old);
+    }
+    output_int(out, old ? 1 : 0);
 }
 
-static int32_t parse_req(
-    const uint8_t *data,
-    size_t len,
-    std::vector<std::string> &out) {
-        if (len < 4) {
-            // can't even read header
-            return -1; 
-        }
-
-        uint32_t args_size = 0;
-        memcpy(&args_size, data, 4);
-        if (args_size > MAX_ARGS_SIZE) {
-            return -1;
-        }
+typedef void (*CommandFn)(Conn *conn, std::vector<std::string> &cmd, std::string &out);
 
-        size_t cur_pos = 4;
-        while (args_size--) {
-            if (cur_pos + 4 > len) {
-                return -1;
-            }
-            uint32_t size = 0;
-            memcpy(&size, &data[cur_pos], 4);
-            if (cur_pos + 4 + size > len) {
-                return -1;
-            }
-            out.push_back(std::string((char *) &data[cur_pos+4], size));
-            cur_pos += 4 + size;
+struct Command {
+    // bounds on cmd.size(), which counts the name
+    size_t min_args = 0;
+    size_t max_args = 0;
+    CommandFn fn = NULL;
+};
 
+// handlers by opcode, NULL for commands a table doesn't serve
+static Command COMMANDS[OP_COUNT];
+static Command SHARED_COMMANDS[OP_COUNT];
+
+static void commands_init() {
+    const size_t ANY = SIZE_MAX;
+    typedef std::vector<std::string> Cmd;
+    COMMANDS[OP_HELLO] = {2, 2, &do_hello};
+    COMMANDS[OP_KEYS] = {1, 1, [](Conn *, Cmd &cmd, std::string &out) { do_keys(cmd, out); }};
+    COMMANDS[OP_INFO] = {1, 1, [](Conn *, Cmd &, std::string &out) { do_info(out); }};
+    COMMANDS[OP_KEYPREFIX] = {3, 3, [](Conn *, Cmd &cmd, std::string &out) { do_keyprefix(cmd, out); }};
+    COMMANDS[OP_KEYRANGE] = {4, 4, [](Conn *, Cmd &cmd, std::string &out) { do_keyrange(cmd, out); }};
+    COMMANDS[OP_GET] = {2, 2, &do_get};
+    COMMANDS[OP_SET] = {3, 3, [](Conn *, Cmd &cmd, std::string &out) { do_set(cmd, out); }};
+    COMMANDS[OP_DEL] = {2, 2, [](Conn *, Cmd &cmd, std::string &out) { do_del(cmd, out); }};
+    COMMANDS[OP_HSET] = {4, 4, [](Conn *, Cmd &cmd, std::string &out) { do_hset(cmd, out); }};
+    COMMANDS[OP_HGET] = {3, 3, [](Conn *, Cmd &cmd, std::string &out) { do_hget(cmd, out); }};
+    COMMANDS[OP_HDEL] = {3, 3, [](Conn *, Cmd &cmd, std::string &out) { do_hdel(cmd, out); }};
+    COMMANDS[OP_HGETALL] = {2, 2, [](Conn *, Cmd &cmd, std::string &out) { do_hgetall(cmd, out); }};
+    COMMANDS[OP_HLEN] = {2, 2, [](Conn *, Cmd &cmd, std::string &out) { do_hlen(cmd, out); }};
+    COMMANDS[OP_LPUSH] = {3, ANY, [](Conn *, Cmd &cmd, std::string &out) { do_push(cmd, out, true); }};
+    COMMANDS[OP_RPUSH] = {3, ANY, [](Conn *, Cmd &cmd, std::string &out) { do_push(cmd, out, false); }};
+    COMMANDS[OP_LPOP] = {2, 2, [](Conn *, Cmd &cmd, std::string &out) { do_pop(cmd, out, true); }};
+    COMMANDS[OP_RPOP] = {2, 2, [](Conn *, Cmd &cmd, std::string &out) { do_pop(cmd, out, false); }};
+    COMMANDS[OP_LRANGE] = {4, 4, [](Conn *, Cmd &cmd, std::string &out) { do_lrange(cmd, out); }};
+    COMMANDS[OP_LLEN] = {2, 2, [](Conn *, Cmd &cmd, std::string &out) { do_llen(cmd, out); }};
+    COMMANDS[OP_PFADD] = {2, ANY, [](Conn *, Cmd &cmd, std::string &out) { do_pfadd(cmd, out); }};
+    COMMANDS[OP_PFCOUNT] = {2, ANY, [](Conn *, Cmd &cmd, std::string &out) { do_pfcount(cmd, out); }};
+    COMMANDS[OP_PFMERGE] = {2, ANY, [](Conn *, Cmd &cmd, std::string &out) { do_pfmerge(cmd, out); }};
+    COMMANDS[OP_MEMORY] = {2, 5, [](Conn *, Cmd &cmd, std::string &out) {
+        const char *sub = cmd[1].c_str();
+        if (strcasecmp(sub, "usage") == 0 && (cmd.size() == 3 || cmd.size() == 5)) {
+            do_memory_usage(cmd, out);
+        } else if (strcasecmp(sub, "stats") == 0 && cmd.size() == 2) {
+            do_memory_stats(out);
+        } else if (strcasecmp(sub, "top") == 0 && cmd.size() <= 3) {
+            do_memory_top(cmd, out);
+        } else {
+            output_err(out, ERR_UNKNOWN, "Unknown command");
         }
-
-        if (cur_pos != len) {
-            return -1; // extra garbage trailing
+    }};
+    COMMANDS[OP_CLIENT] = {3, ANY, [](Conn *conn, Cmd &cmd, std::string &out) {
+        if (strcasecmp(cmd[1].c_str(), "tracking") == 0) {
+            do_client_tracking(conn, cmd, out);
+        } else {
+            output_err(out, ERR_UNKNOWN, "Unknown command");
         }
-        return 0;
-    }
+    }};
+
+    SHARED_COMMANDS[OP_HELLO] = COMMANDS[OP_HELLO];
+    SHARED_COMMANDS[OP_GET] = {2, 2, [](Conn *, Cmd &cmd, std::string &out) { do_shared_get(cmd, out); }};
+    SHARED_COMMANDS[OP_SET] = {3, 3, [](Conn *, Cmd &cmd, std::string &out) { do_shared_set(cmd, out); }};
+    SHARED_COMMANDS[OP_DEL] = {2, 2, [](Conn *, Cmd &cmd, std::string &out) { do_shared_del(cmd, out); }};
+}
 
+// op is -1 for a v1 request whose name isn't a command
 static void do_request(
+        Conn *conn,
+        int32_t op,
         std::vector<std::string> &cmd,
         std::string &out
     ) {
-        // strcasecmp just checks if the cmd keyword is equal to the RHS
-        if (cmd.size() == 1 && strcasecmp(cmd[0].c_str(), "keys") == 0) {
-            do_keys(cmd, out);
-        } else if (cmd.size() == 2 && strcasecmp(cmd[0].c_str(), "get") == 0) {
-            do_get(cmd, out);
-        } else if (cmd.size() == 3 && strcasecmp(cmd[0].c_str(), "set") == 0) {
-            do_set(cmd, out);
-        } else if (cmd.size() == 2 && strcasecmp(cmd[0].c_str(), "del") == 0) {
-            do_del(cmd, out);
-        } else {
+        const Command *table = config.threads > 1 ? SHARED_COMMANDS : COMMANDS;
+        const Command *command = op >= 0 ? &table[op] : NULL;
+        if (command && !command->fn && config.threads > 1) {
+            output_err(out, ERR_UNKNOWN, "Unknown command, --threads only serves get, set and del");
+        } else if (!command || !command->fn
+                || cmd.size() < command->min_args || cmd.size() > command->max_args) {
             output_err(out, ERR_UNKNOWN, "Unknown command");
+        } else {
+            command->fn(conn, cmd, out);
         }
     }
 
-static bool try_one_req(Conn *conn) {
-    if (conn->read_buf_size < 4) {
-        // insufficient data in buf, can't read header, try again next iter
-        return false;
+// captured requests are written out in batches this big, or at least
+// this often when traffic is light
+const size_t CAPTURE_FLUSH_BYTES = 64 << 10;
+const uint64_t CAPTURE_FLUSH_NS = 1000000000;
+
+static void capture_flush() {
+    const char *buf = data.capture_buf.data();
+    size_t size = data.capture_buf.size();
+    while (size > 0) {
+        ssize_t res = write(data.capture_fd, buf, size);
+        if (res < 0 && errno == EINTR) {
+            continue;
+        }
+        if (res < 0) {
+            // a partial trace is still useful, keep what we have
+            fprintf(stderr, "[%d] capture write error, capture stopped\n", errno);
+            close(data.capture_fd);
+            data.capture_fd = -1;
+            break;
+        }
+        buf += res;
+        size -= (size_t) res;
+    }
+    data.capture_buf.clear();
+    data.capture_flush_ns = monotonic_ns();
+}
+
+static void capture_req(Conn *conn, const uint8_t *req, uint32_t len) {
+    if (data.capture_fd < 0) {
+        return;
+    }
+    trace_append(&data.capture_buf, monotonic_ns() - data.capture_start_ns, conn->id, req, len);
+    if (data.capture_buf.size() >= CAPTURE_FLUSH_BYTES) {
+        capture_flush();
+    }
+}
+
+// loads res into the write buffer, after any pushes that are still queued,
+// and starts sending it
+static void send_reply(Conn *conn, std::string &res) {
+    if (4 + res.size() > MAX_MSG_SIZE) {
+        res.clear();
+        output_err(res, ERR_TOO_BIG, "Response too big!");
     }
+    uint32_t write_len = (uint32_t) res.size();
+    memcpy(&conn->write_buf[conn->write_buf_size], &write_len, 4);
+    memcpy(&conn->write_buf[conn->write_buf_size + 4], res.data(), res.size());
+    conn->write_buf_size += 4 + write_len;
+
+    // update state
+    conn->state = STATE_RES;
+    handle_state_res(conn);
+}
 
+static bool try_one_req(Conn *conn) {
+    // read len from header, a u32 in v1 and a varint in v2
     uint32_t len = 0;
-    memcpy(&len, conn->read_buf, 4); // read len from header 
-    if (len > MAX_MSG_SIZE) {
+    size_t header = 4;
+    if (conn->proto == PROTO_V2) {
+        int32_t n = varint_get(conn->read_buf, conn->read_buf_size, &len);
+        if (n == 0) {
+            // insufficient data in buf, can't read header, try again next iter
+            return false;
+        }
+        header = n > 0 ? (size_t) n : 0;
+    } else {
+        if (conn->read_buf_size < 4) {
+            // insufficient data in buf, can't read header, try again next iter
+            return false;
+        }
+        memcpy(&len, conn->read_buf, 4);
+    }
+    if (!header || len > MAX_MSG_SIZE) {
         printf("msg too long");
         conn->state = STATE_END;
         return false;
     }
-    if (4 + len > conn->read_buf_size) {
+    if (header + len > conn->read_buf_size) {
         // insufficient data in buf, try again next iter
         return false;
     }
 
-    // parse req and store in the cmd vector
+    const uint8_t *body = &conn->read_buf[header];
+    capture_req(conn, body, len);
+
+    // parse req and store in the cmd vector, v2 gives the opcode directly
     std::vector<std::string> cmd;
-    if (parse_req(&conn->read_buf[4], len, cmd)) {
+    uint32_t v2_op = 0;
+    int32_t err = conn->proto == PROTO_V2
+        ? proto_parse_v2(body, len, &v2_op, cmd)
+        : proto_parse_v1(body, len, cmd);
+    if (err) {
         printf("bad req");
         conn->state = STATE_END;
         return false;
     }
+    int32_t op = (int32_t) v2_op;
+    if (conn->proto == PROTO_V1) {
+        op = cmd.empty() ? -1 : proto_opcode(cmd[0].c_str());
+    }
 
     // generate res
     std::string res;
-    do_request(cmd, res);
-
-    // load res into buffer
-    if (4 + res.size() > MAX_MSG_SIZE) {
-        res.clear();
-        output_err(res, ERR_TOO_BIG, "Response too big!");
+    do_request(conn, op, cmd, res);
+    if (conn->state == STATE_END) {
+        return false; // fell behind on its own invalidations
     }
-    uint32_t write_len = (uint32_t) res.size();
-    memcpy(conn->write_buf, &write_len, 4);
-    memcpy(&conn->write_buf[4], res.data(), res.size());
-    conn->write_buf_size = 4 + write_len;
 
     // shift the next request in the buffer forward
-    size_t remaining_bytes = conn->read_buf_size - 4 - len;
+    size_t remaining_bytes = conn->read_buf_size - header - len;
     if (remaining_bytes) {
-        memmove(conn->read_buf, &conn->read_buf[4 + len], remaining_bytes);
+        memmove(conn->read_buf, &conn->read_buf[header + len], remaining_bytes);
     }
     conn->read_buf_size = remaining_bytes;
 
-    // update state
-    conn->state = STATE_RES;
-    handle_state_res(conn);
+    if (conn->state == STATE_WAIT) {
+        return false; // the reply comes from the I/O pool
+    }
+    send_reply(conn, res);
 
     // if the req was fully processed, continue outer loop
     return (conn->state == STATE_REQ);
@@ -415,6 +1827,131 @@ static void connection_io(Conn *conn) {
         handle_state_req(conn);
     } else if (conn->state == STATE_RES) {
         handle_state_res(conn);
+        // requests that arrived while the reply was stuck
+        while (conn->state == STATE_REQ && try_one_req(conn)) {}
+    }
+}
+
+static void conn_destroy(Conn *conn) {
+    if (conn->tracking != TRACK_OFF) {
+        tracking_forget(&data.tracking, conn->fd);
+    }
+    fd_to_conn[conn->fd] = NULL;
+    close(conn->fd);
+    free(conn);
+}
+
+static void tier_spill_done(TierTask *t) {
+    data.tier_write_bytes -= t->io.buf.size();
+    Entry *entry = data.db.get(t->key);
+    if (!entry || entry->spill_id != t->spill_id) {
+        return; // used or changed meanwhile, the record is dead
+    }
+    entry->spill_id = 0;
+    if (t->io.err) {
+        stats.tier_io_errors++;
+        tier_touch(entry);
+        return;
+    }
+
+    entry->tier = TIER_COLD;
+    entry->cold_seg = t->seg;
+    entry->cold_off = t->off;
+    entry->cold_len = (uint32_t) entry->value.size();
+    std::string().swap(entry->value);
+    vlog_add_live(&data.vlog, t->seg, t->io.buf.size());
+    dlist_insert_before(&t->seg->records, &entry->tier_node);
+    stats.tier_spills++;
+}
+
+static void tier_read_done(TierTask *t) {
+    Conn *conn = t->conn;
+    conn->io_pending = false;
+    if (conn->state == STATE_END) {
+        conn_destroy(conn);
+        return;
+    }
+
+    std::string res;
+    Entry *entry = data.db.get(t->key);
+    if (!entry || entry->tier != TIER_COLD
+            || entry->cold_seg != t->seg || entry->cold_off != t->off) {
+        // it changed while we were reading and the client may have been
+        // told so already, answer with what it is now and track that
+        get_str(conn, entry, res);
+        if (conn->io_pending) {
+            return; // moved by compaction, read it again
+        }
+    } else if (t->io.err) {
+        stats.tier_io_errors++;
+        output_err(res, ERR_UNKNOWN, "Value log read failed");
+    } else {
+        std::string buf;
+        std::string_view val;
+        if (str_decode(t->io.buf, t->encoding, t->raw_len, buf, &val)) {
+            output_str(res, val);
+            // it's in use again, keep it in memory
+            tier_drop(entry);
+            entry->value.swap(t->io.buf);
+            tier_touch(entry);
+            track_read(conn, entry->key, entry->node.hashcode);
+        } else {
+            output_corrupt(res); // and leave the record be
+        }
+    }
+
+    send_reply(conn, res);
+    while (conn->state == STATE_REQ && try_one_req(conn)) {}
+}
+
+static void tier_move_done(TierTask *t) {
+    data.tier_write_bytes -= t->io.len;
+    Entry *entry = data.db.get(t->key);
+    if (!entry || entry->tier != TIER_COLD
+            || entry->cold_seg != t->seg || entry->cold_off != t->off) {
+        return; // the copy is dead already
+    }
+    if (t->io.err) {
+        stats.tier_io_errors++;
+        dlist_insert_before(&t->seg->records, &entry->tier_node);
+        ValueSegment *seg = t->seg;
+        seg->compact_backoff_ms = seg->compact_backoff_ms
+            ? std::min(seg->compact_backoff_ms * 2, TIER_COMPACT_BACKOFF_MAX_MS)
+            : TIER_COMPACT_BACKOFF_MS;
+        seg->compact_after_ms = monotonic_ms() + seg->compact_backoff_ms;
+        return;
+    }
+    t->seg->compact_backoff_ms = 0;
+
+    vlog_del_live(&data.vlog, t->seg, t->io.len);
+    vlog_add_live(&data.vlog, t->dst, t->io.len);
+    entry->cold_seg = t->dst;
+    entry->cold_off = t->dst_off;
+    dlist_insert_before(&t->dst->records, &entry->tier_node);
+    stats.tier_compact_moves++;
+}
+
+// acts on the tasks the I/O pool finished
+static void tier_handle_done() {
+    std::vector<IoTask *> done;
+    iopool_take_done(&data.io, &done);
+    for (IoTask *task : done) {
+        TierTask *t = (TierTask *) task->arg;
+        if (t->kind == TIER_SPILL) {
+            tier_spill_done(t);
+        } else if (t->kind == TIER_READ) {
+            tier_read_done(t);
+        } else {
+            tier_move_done(t);
+        }
+
+        t->seg->pending_io--;
+        vlog_try_drop(&data.vlog, t->seg);
+        if (t->dst) {
+            t->dst->pending_io--;
+            vlog_try_drop(&data.vlog, t->dst);
+        }
+        delete t;
     }
 }
 
@@ -427,10 +1964,13 @@ static void save_conn(std::vector<Conn *> &fd_to_conn, struct Conn *conn) {
     fd_to_conn[conn->fd] = conn;
 }
 
-static int32_t accept_new_conn(std::vector<Conn *> &fd_to_conn, int server_fd) {
-    struct sockaddr_in client_addr = {};
+static int32_t accept_new_conn(std::vector<Conn *> &fd_to_conn, int server_fd, bool tcp) {
+    struct sockaddr_storage client_addr = {};
     socklen_t socklen = sizeof(client_addr);
     int conn_fd = accept(server_fd, (struct sockaddr *)&client_addr, &socklen);
+    if (conn_fd < 0 && errno == EAGAIN) {
+        return -1; // another loop sharing the listener got there first
+    }
     if (conn_fd < 0) {
         printf("accept() error");
         return -1;
@@ -438,13 +1978,24 @@ static int32_t accept_new_conn(std::vector<Conn *> &fd_to_conn, int server_fd) {
 
     fd_set_nonblocking(conn_fd);
 
+    // pushes are small and unsolicited, don't let nagle hold them back
+    // waiting for the client to ack the previous reply
+    if (tcp) {
+        int val = 1;
+        setsockopt(conn_fd, IPPROTO_TCP, TCP_NODELAY, &val, sizeof(val));
+    }
+
     struct Conn *conn = (struct Conn *) malloc(sizeof(struct Conn));
     if (!conn) {
         close(conn_fd);
         return -1;
     }
     conn->fd = conn_fd;
+    conn->id = data.next_conn_id++;
     conn->state = STATE_REQ;
+    conn->tracking = TRACK_OFF;
+    conn->proto = PROTO_V1;
+    conn->io_pending = false;
     conn->read_buf_size = 0;
     conn->write_buf_size = 0;
     conn->write_buf_sent = 0;
@@ -452,16 +2003,151 @@ static int32_t accept_new_conn(std::vector<Conn *> &fd_to_conn, int server_fd) {
     return 0;
 }
 
-int main() {
+static void usage_die(const char *arg) {
+    fprintf(stderr, "bad option: %s\n", arg);
+    fprintf(stderr, "usage: ./server"
+        " [--hash-max-packed-entries N]"
+        " [--hash-max-packed-value N]"
+        " [--compress-min-size BYTES]"
+        " [--compress-min-saving PERCENT]"
+        " [--ordered-index]"
+        " [--tracking-slots POW2]"
+        " [--tracking-max-entries N]"
+        " [--unix-socket PATH]"
+        " [--capture FILE]"
+        " [--threads N]"
+        " [--tier-dir DIR]"
+        " [--tier-cold-secs N]"
+        " [--tier-min-size BYTES]"
+        " [--tier-io-threads N]"
+        " [--tier-segment-size BYTES]"
+        " [--tier-compact-live-pct PERCENT]\n");
+    exit(1);
+}
+
+static void parse_args(int argc, char **argv) {
+    for (int i = 1; i < argc; i++) {
+        // flags without a value
+        if (strcmp(argv[i], "--ordered-index") == 0) {
+            config.ordered_index = true;
+            continue;
+        }
+
+        if (i + 1 >= argc) {
+            usage_die(argv[i]); // every other option takes a value
+        }
+        if (strcmp(argv[i], "--hash-max-packed-entries") == 0) {
+            config.hash_limits.max_packed_entries = strtoull(argv[++i], NULL, 10);
+        } else if (strcmp(argv[i], "--hash-max-packed-value") == 0) {
+            config.hash_limits.max_packed_value = strtoull(argv[++i], NULL, 10);
+        } else if (strcmp(argv[i], "--tracking-slots") == 0) {
+            config.tracking_slots = strtoull(argv[++i], NULL, 10);
+            if (!config.tracking_slots || (config.tracking_slots & (config.tracking_slots - 1))) {
+                usage_die(argv[i]);
+            }
+        } else if (strcmp(argv[i], "--tracking-max-entries") == 0) {
+            config.tracking_max_entries = strtoull(argv[++i], NULL, 10);
+            if (!config.tracking_max_entries) {
+                usage_die(argv[i]);
+            }
+        } else if (strcmp(argv[i], "--compress-min-size") == 0) {
+            config.compress_min_size = strtoull(argv[++i], NULL, 10);
+        } else if (strcmp(argv[i], "--compress-min-saving") == 0) {
+            config.compress_min_saving = strtoull(argv[++i], NULL, 10);
+            if (config.compress_min_saving > 100) {
+                usage_die(argv[i]);
+            }
+        } else if (strcmp(argv[i], "--unix-socket") == 0) {
+            config.unix_path = argv[++i];
+            if (config.unix_path.size() >= sizeof(sockaddr_un::sun_path)) {
+                usage_die(argv[i]);
+            }
+        } else if (strcmp(argv[i], "--capture") == 0) {
+            config.capture_path = argv[++i];
+        } else if (strcmp(argv[i], "--threads") == 0) {
+            config.threads = strtoull(argv[++i], NULL, 10);
+            if (!config.threads) {
+                usage_die(argv[i]);
+            }
+        } else if (strcmp(argv[i], "--tier-dir") == 0) {
+            config.tier_dir = argv[++i];
+        } else if (strcmp(argv[i], "--tier-cold-secs") == 0) {
+            config.tier_cold_ms = strtoull(argv[++i], NULL, 10) * 1000;
+        } else if (strcmp(argv[i], "--tier-min-size") == 0) {
+            config.tier_min_size = strtoull(argv[++i], NULL, 10);
+        } else if (strcmp(argv[i], "--tier-io-threads") == 0) {
+            config.tier_io_threads = strtoull(argv[++i], NULL, 10);
+            if (!config.tier_io_threads) {
+                usage_die(argv[i]);
+            }
+        } else if (strcmp(argv[i], "--tier-segment-size") == 0) {
+            config.tier_segment_size = strtoull(argv[++i], NULL, 10);
+            if (!config.tier_segment_size) {
+                usage_die(argv[i]);
+            }
+        } else if (strcmp(argv[i], "--tier-compact-live-pct") == 0) {
+            config.tier_compact_live_pct = (uint32_t) strtoull(argv[++i], NULL, 10);
+            if (config.tier_compact_live_pct > 100) {
+                usage_die(argv[i]);
+            }
+        } else {
+            usage_die(argv[i]);
+        }
+    }
+
+    // these all assume a single loop owns the keyspace
+    if (config.threads > 1 && config.ordered_index) {
+        usage_die("--ordered-index with --threads");
+    }
+    if (config.threads > 1 && !config.capture_path.empty()) {
+        usage_die("--capture with --threads");
+    }
+    if (config.threads > 1 && !config.tier_dir.empty()) {
+        usage_die("--tier-dir with --threads");
+    }
+}
+
+// opens a nonblocking listener on a unix socket at path
+static int listen_unix(const std::string &path) {
+    int fd = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (fd < 0) {
+        die("socket()");
+    }
+
+    // a socket left behind by an earlier run would make bind fail, but
+    // don't remove anything that isn't a socket
+    struct stat st;
+    if (stat(path.c_str(), &st) == 0 && S_ISSOCK(st.st_mode)) {
+        unlink(path.c_str());
+    }
+
+    struct sockaddr_un addr = {};
+    addr.sun_family = AF_UNIX;
+    memcpy(addr.sun_path, path.data(), path.size());
+    if (bind(fd, (const sockaddr *)&addr, sizeof(addr))) {
+        die("bind()");
+    }
+    if (listen(fd, SOMAXCONN)) {
+        die("listen()");
+    }
+    fd_set_nonblocking(fd);
+    return fd;
+}
+
+// opens a nonblocking listener on tcp port 3535
+static int listen_tcp() {
     // open socket
     int server_fd = socket(AF_INET, SOCK_STREAM, 0);
     if (server_fd< 0) {
         die("socket()");
     }
 
-    // enable reuse of addresses
+    // enable reuse of addresses, and of the port by the other loops
     int val = 1;
     setsockopt(server_fd, SOL_SOCKET, SO_REUSEADDR, &val, sizeof(val));
+    if (config.threads > 1) {
+        setsockopt(server_fd, SOL_SOCKET, SO_REUSEPORT, &val, sizeof(val));
+    }
     
     // bind address and port number to socket
     struct sockaddr_in addr = {};
@@ -479,12 +2165,13 @@ int main() {
         die("listen()");
     }
 
-    // maps fds to connections
-    std::vector<Conn *> fd_to_conn;
-
     // set server fd to nonblocking mode 
     fd_set_nonblocking(server_fd);
+    return server_fd;
+}
 
+// runs one event loop, until the process exits
+static void serve(int server_fd, int unix_fd) {
     std::vector<struct pollfd> poll_args;
     while (true) {
         // prep args of the poll 
@@ -492,10 +2179,22 @@ int main() {
 
         struct pollfd poll_fd = {server_fd, POLLIN, 0};
         poll_args.push_back(poll_fd);
+        size_t unix_idx = poll_args.size();
+        if (unix_fd >= 0) {
+            struct pollfd unix_poll_fd = {unix_fd, POLLIN, 0};
+            poll_args.push_back(unix_poll_fd);
+        }
+        size_t wake_idx = poll_args.size();
+        if (tier_on()) {
+            struct pollfd wake_fd = {iopool_wake_fd(&data.io), POLLIN, 0};
+            poll_args.push_back(wake_fd);
+        }
+        size_t first_conn = poll_args.size();
 
         // add connection fds to poll args
         for (Conn *conn : fd_to_conn) {
-            if (!conn) {
+            if (!conn || conn->io_pending) {
+                // waiting conns are left alone until their I/O is done
                 continue;
             }
 
@@ -508,14 +2207,19 @@ int main() {
             poll_args.push_back(poll_fd);
         }
 
-        // poll for active fds
-        int res = poll(poll_args.data(), (nfds_t) poll_args.size(), 1000);
-        if (res < 0) {
+        // poll for active fds, waking up often enough to spill on time and
+        // not at all while a memory pass has work left
+        int timeout_ms = tier_on() ? 100 : 1000;
+        if (data.memscan.running) {
+            timeout_ms = 0;
+        }
+        int res = poll(poll_args.data(), (nfds_t) poll_args.size(), timeout_ms);
+        if (res < 0 && errno != EINTR) {
             die("poll");
         }
 
         // process active conns
-        for (size_t i = 1; i < poll_args.size(); i++) {
+        for (size_t i = first_conn; i < poll_args.size(); i++) {
             if (!poll_args[i].revents) {
                 // if inactive, skip
                 continue;
@@ -523,21 +2227,70 @@ int main() {
             Conn *conn = fd_to_conn[poll_args[i].fd];
             connection_io(conn);
 
-            if (conn->state != STATE_END) {
-                continue;
+            // if this is the end state, need to destroy conn, unless a task
+            // still points at it. it's destroyed once that comes back.
+            if (conn->state == STATE_END && !conn->io_pending) {
+                conn_destroy(conn);
             }
-            // if this is the end state, need to destroy conn
-            fd_to_conn[conn->fd] = NULL;
-            close(conn->fd);
-            free(conn);
+        }
+
+        if (tier_on()) {
+            if (poll_args[wake_idx].revents) {
+                tier_handle_done();
+            }
+            tier_spill_some();
+            tier_compact_some();
+        }
+
+        if (data.memscan.running) {
+            memscan_step();
+        }
+
+        if (data.capture_fd >= 0 && !data.capture_buf.empty()
+                && monotonic_ns() - data.capture_flush_ns >= CAPTURE_FLUSH_NS) {
+            capture_flush();
         }
 
         // accept new conn if server fd is active 
         if (poll_args[0].revents) {
-            accept_new_conn(fd_to_conn, server_fd);
+            accept_new_conn(fd_to_conn, server_fd, true);
+        }
+        if (unix_fd >= 0 && poll_args[unix_idx].revents) {
+            accept_new_conn(fd_to_conn, unix_fd, false);
         }
 
     }
+}
+
+int main(int argc, char **argv) {
+    parse_args(argc, argv);
+    commands_init();
+    tracking_init(&data.tracking, config.tracking_slots, config.tracking_max_entries);
+    if (tier_on()) {
+        if (vlog_open(&data.vlog, config.tier_dir, config.tier_segment_size)) {
+            die("value log");
+        }
+        if (iopool_start(&data.io, config.tier_io_threads)) {
+            die("io pool");
+        }
+    }
+    if (!config.capture_path.empty()) {
+        data.capture_fd = open(config.capture_path.c_str(),
+            O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+        if (data.capture_fd < 0) {
+            die("capture file");
+        }
+        data.capture_buf.append(TRACE_MAGIC, sizeof(TRACE_MAGIC));
+        data.capture_start_ns = data.capture_flush_ns = monotonic_ns();
+    }
 
+    // every loop gets its own tcp listener and the kernel spreads new
+    // connections over them. the unix listener is shared.
+    int unix_fd = config.unix_path.empty() ? -1 : listen_unix(config.unix_path);
+    for (size_t i = 1; i < config.threads; i++) {
+        int server_fd = listen_tcp();
+        std::thread(serve, server_fd, unix_fd).detach();
+    }
+    serve(listen_tcp(), unix_fd);
     return 0;
 }
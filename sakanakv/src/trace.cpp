@@ -0,0 +1,36 @@
+#include <stdio.h>
+#include <string.h>
+#include "trace.h"
+
+int32_t trace_load(const char *path, std::vector<TraceRecord> *records) {
+    FILE *file = fopen(path, "rb");
+    if (!file) {
+        return -1;
+    }
+
+    char magic[sizeof(TRACE_MAGIC)];
+    if (fread(magic, 1, sizeof(magic), file) != sizeof(magic)
+            || memcmp(magic, TRACE_MAGIC, sizeof(magic)) != 0) {
+        fclose(file);
+        return -1;
+    }
+
+    while (true) {
+        uint8_t header[TRACE_RECORD_HEADER];
+        if (fread(header, 1, sizeof(header), file) != sizeof(header)) {
+            break;
+        }
+        TraceRecord rec;
+        uint32_t len = 0;
+        memcpy(&rec.ts_ns, &header[0], 8);
+        memcpy(&rec.conn_id, &header[8], 4);
+        memcpy(&len, &header[12], 4);
+        rec.req.resize(len);
+        if (len && fread(&rec.req[0], 1, len, file) != len) {
+            break;
+        }
+        records->push_back(std::move(rec));
+    }
+    fclose(file);
+    return 0;
+}
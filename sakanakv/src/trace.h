@@ -0,0 +1,44 @@
+#pragma once
+
+#include <stddef.h>
+#include <stdint.h>
+#include <string>
+#include <vector>
+
+/**
+ * Binary traces of the requests a server received, see --capture.
+ *
+ * A trace starts with TRACE_MAGIC and then holds one record per request:
+ * [u64 ns since the capture started][u32 connection id][u32 len][len bytes]
+ * where the bytes are the request as it was framed on the wire, without
+ * its length prefix. That's v1 framing up to a HELLO 2 on the connection
+ * and v2 after it, see proto.h. Connection ids are unique for the life of
+ * the server, unlike fds. Records are in the order the server handled them.
+ */
+
+const char TRACE_MAGIC[8] = {'S', 'K', 'T', 'R', 'A', 'C', 'E', '1'};
+const size_t TRACE_RECORD_HEADER = 16;
+
+struct TraceRecord {
+    uint64_t ts_ns = 0;
+    uint32_t conn_id = 0;
+    std::string req;
+};
+
+inline void trace_append(
+        std::string *buf,
+        uint64_t ts_ns,
+        uint32_t conn_id,
+        const uint8_t *req,
+        uint32_t len
+    ) {
+    buf->append((char *)&ts_ns, 8);
+    buf->append((char *)&conn_id, 4);
+    buf->append((char *)&len, 4);
+    buf->append((const char *)req, len);
+}
+
+// reads a whole trace. a record cut short at the end, as left by a server
+// that was killed mid write, is dropped. returns -1 if the file can't be
+// read or isn't a trace.
+int32_t trace_load(const char *path, std::vector<TraceRecord> *records);
@@ -0,0 +1,138 @@
+#include <algorithm>
+#include "tracking.h"
+
+void tracking_init(Tracking *t, size_t nslots, size_t max_entries) {
+    t->mask = nslots - 1;
+    t->slots.assign(nslots, std::vector<uint32_t>());
+    t->entries = 0;
+    t->max_entries = max_entries;
+    t->fds.clear();
+    t->bcast_fds.clear();
+}
+
+static TrackedFd &tracked(Tracking *t, uint32_t fd) {
+    if (fd >= t->fds.size()) {
+        t->fds.resize(fd + 1);
+    }
+    return t->fds[fd];
+}
+
+// takes fd out of every slot it's in
+static void leave_slots(Tracking *t, uint32_t fd) {
+    TrackedFd &tf = tracked(t, fd);
+    for (uint32_t slot : tf.slots) {
+        std::vector<uint32_t> &fds = t->slots[slot];
+        auto it = std::find(fds.begin(), fds.end(), fd);
+        if (it != fds.end()) {
+            fds.erase(it);
+            t->entries--;
+        }
+    }
+    std::vector<uint32_t>().swap(tf.slots);
+    tf.entries = 0;
+}
+
+// drops the cleared slots from fd's list once they are most of it
+static void compact_slots(Tracking *t, uint32_t fd) {
+    TrackedFd &tf = tracked(t, fd);
+    if (tf.slots.size() < 2 * tf.entries + 16) {
+        return;
+    }
+    std::sort(tf.slots.begin(), tf.slots.end());
+    tf.slots.erase(std::unique(tf.slots.begin(), tf.slots.end()), tf.slots.end());
+    tf.slots.erase(
+        std::remove_if(tf.slots.begin(), tf.slots.end(), [t, fd](uint32_t slot) {
+            const std::vector<uint32_t> &fds = t->slots[slot];
+            return std::find(fds.begin(), fds.end(), fd) == fds.end();
+        }),
+        tf.slots.end());
+}
+
+bool tracking_remember(Tracking *t, uint32_t fd, uint32_t slot, uint32_t *fallback_fd) {
+    std::vector<uint32_t> &fds = t->slots[slot];
+    if (std::find(fds.begin(), fds.end(), fd) != fds.end()) {
+        return false;
+    }
+
+    bool fell_back = false;
+    if (t->entries >= t->max_entries) {
+        // the biggest tracker frees the most
+        uint32_t victim = fd;
+        for (uint32_t i = 0; i < t->fds.size(); i++) {
+            if (t->fds[i].entries > tracked(t, victim).entries) {
+                victim = i;
+            }
+        }
+        leave_slots(t, victim);
+        *fallback_fd = victim;
+        fell_back = true;
+        if (victim == fd) {
+            return true;
+        }
+    }
+
+    fds.push_back(fd);
+    t->entries++;
+    TrackedFd &tf = tracked(t, fd);
+    tf.slots.push_back(slot);
+    tf.entries++;
+    compact_slots(t, fd);
+    return fell_back;
+}
+
+void tracking_take_slot(Tracking *t, uint32_t slot, std::vector<uint32_t> *fds) {
+    std::vector<uint32_t> &cur = t->slots[slot];
+    t->entries -= cur.size();
+    for (uint32_t fd : cur) {
+        tracked(t, fd).entries--;
+    }
+    fds->insert(fds->end(), cur.begin(), cur.end());
+    std::vector<uint32_t>().swap(cur);
+}
+
+void tracking_match_prefixes(Tracking *t, std::string_view key, std::vector<uint32_t> *fds) {
+    for (uint32_t fd : t->bcast_fds) {
+        for (const std::string &prefix : t->fds[fd].prefixes) {
+            if (key.substr(0, prefix.size()) == prefix) {
+                fds->push_back(fd);
+                break;
+            }
+        }
+    }
+}
+
+void tracking_add_prefix(Tracking *t, uint32_t fd, std::string_view prefix) {
+    TrackedFd &tf = tracked(t, fd);
+    if (tf.prefixes.empty()) {
+        t->bcast_fds.push_back(fd);
+    }
+    tf.prefixes.emplace_back(prefix);
+}
+
+void tracking_add_fallback_prefix(Tracking *t, uint32_t fd, std::string_view prefix) {
+    TrackedFd &tf = tracked(t, fd);
+    for (const std::string &cur : tf.prefixes) {
+        if (prefix.substr(0, cur.size()) == cur) {
+            return;
+        }
+    }
+    if (tf.prefixes.size() >= TRACKING_FALLBACK_MAX_PREFIXES) {
+        tf.prefixes.clear();
+        tf.prefixes.emplace_back(); // every key
+        return;
+    }
+    tracking_add_prefix(t, fd, prefix);
+}
+
+void tracking_forget(Tracking *t, uint32_t fd) {
+    if (fd >= t->fds.size()) {
+        return;
+    }
+    leave_slots(t, fd);
+
+    TrackedFd &tf = t->fds[fd];
+    if (!tf.prefixes.empty()) {
+        std::vector<std::string>().swap(tf.prefixes);
+        t->bcast_fds.erase(std::find(t->bcast_fds.begin(), t->bcast_fds.end(), fd));
+    }
+}
@@ -0,0 +1,80 @@
+#pragma once
+
+#include <stddef.h>
+#include <stdint.h>
+#include <string>
+#include <string_view>
+#include <vector>
+
+/**
+ * Bookkeeping for server assisted client side caching.
+ *
+ * Instead of remembering every key a client read, keys are grouped into
+ * slots by their hashcode and we only remember which clients (by fd) read
+ * something in each slot. Once any key in a slot changes, every client in
+ * it is told to drop its cached keys for that slot and the slot is cleared.
+ *
+ * Clients that read too many keys for that to work can subscribe to key
+ * prefixes instead, which costs nothing per key: every change to a key
+ * with a matching prefix is broadcast to them.
+ *
+ * The number of (slot, client) pairs is capped. When the cap is hit, the
+ * client in the most slots falls back to broadcast: it leaves every slot,
+ * drops its whole cache and from then on is subscribed to the prefix of
+ * each key it reads. Past TRACKING_FALLBACK_MAX_PREFIXES of those it gets
+ * every change instead.
+ */
+
+// prefixes a client that fell back collects before it's sent everything
+const size_t TRACKING_FALLBACK_MAX_PREFIXES = 64;
+
+// what we know about one fd
+struct TrackedFd {
+    // slots it joined. a slot that got cleared since stays in here until
+    // the list is compacted, entries says how many it's really in.
+    std::vector<uint32_t> slots;
+    size_t entries = 0;
+    std::vector<std::string> prefixes; // broadcast subscriptions
+};
+
+struct Tracking {
+    size_t mask = 0;
+    std::vector<std::vector<uint32_t>> slots; // fds that read from each slot
+    size_t entries = 0; // number of fds over all slots
+    size_t max_entries = 0;
+    std::vector<TrackedFd> fds; // indexed by fd
+    std::vector<uint32_t> bcast_fds; // fds with at least one prefix
+};
+
+// nslots must be a power of 2
+void tracking_init(Tracking *t, size_t nslots, size_t max_entries);
+
+inline uint32_t tracking_slot(Tracking *t, uint64_t hashcode) {
+    return (uint32_t)(hashcode & t->mask);
+}
+
+// records that fd read a key in slot. returns true if the cap was hit and
+// some fd, written to *fallback_fd, was dropped from every slot and has to
+// fall back to broadcast. if that's fd itself, the read isn't recorded.
+bool tracking_remember(Tracking *t, uint32_t fd, uint32_t slot, uint32_t *fallback_fd);
+
+// moves the clients tracking slot into fds and clears the slot
+void tracking_take_slot(Tracking *t, uint32_t slot, std::vector<uint32_t> *fds);
+
+// appends every broadcast client with a prefix of key to fds, at most once each
+void tracking_match_prefixes(Tracking *t, std::string_view key, std::vector<uint32_t> *fds);
+
+void tracking_add_prefix(Tracking *t, uint32_t fd, std::string_view prefix);
+
+// subscribes a client that fell back to prefix, unless it's covered
+// already. swaps its prefixes for "" once it has too many.
+void tracking_add_fallback_prefix(Tracking *t, uint32_t fd, std::string_view prefix);
+
+// drops all state about fd, used when it turns tracking off or disconnects.
+// costs O(slots and prefixes of fd).
+void tracking_forget(Tracking *t, uint32_t fd);
+
+// true if nobody is tracking anything, so writes can skip the lookups
+inline bool tracking_idle(Tracking *t) {
+    return t->entries == 0 && t->bcast_fds.empty();
+}
@@ -0,0 +1,107 @@
+#include <errno.h>
+#include <fcntl.h>
+#include <string.h>
+#include <unistd.h>
+#include <algorithm>
+#include <sys/stat.h>
+#include "valuelog.h"
+
+static std::string segment_path(ValueLog *log, uint32_t id) {
+    return log->dir + "/values." + std::to_string(id);
+}
+
+static ValueSegment *segment_create(ValueLog *log) {
+    uint32_t id = log->next_id;
+    // anything left over from an earlier run is unreachable, start empty
+    int fd = open(segment_path(log, id).c_str(), O_RDWR | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+    if (fd < 0) {
+        return NULL;
+    }
+    log->next_id++;
+
+    ValueSegment *seg = new ValueSegment();
+    seg->id = id;
+    seg->fd = fd;
+    log->segments.push_back(seg);
+    return seg;
+}
+
+int32_t vlog_open(ValueLog *log, const std::string &dir, uint64_t segment_max) {
+    if (mkdir(dir.c_str(), 0755) && errno != EEXIST) {
+        return -1;
+    }
+    log->dir = dir;
+    log->segment_max = segment_max;
+    log->active = segment_create(log);
+    return log->active ? 0 : -1;
+}
+
+void vlog_record(std::string_view key, std::string_view val, std::string *out) {
+    uint32_t key_len = (uint32_t) key.size();
+    uint32_t val_len = (uint32_t) val.size();
+    out->clear();
+    out->reserve(vlog_record_size(key.size(), val.size()));
+    out->append((char *)&key_len, 4);
+    out->append((char *)&val_len, 4);
+    out->append(key.data(), key.size());
+    out->append(val.data(), val.size());
+}
+
+int32_t vlog_reserve(ValueLog *log, size_t len, ValueSegment **seg, uint64_t *offset) {
+    ValueSegment *active = log->active;
+    if (active->size > 0 && active->size + len > log->segment_max) {
+        ValueSegment *next = segment_create(log);
+        if (!next) {
+            return -1;
+        }
+        log->active = next;
+        vlog_try_drop(log, active); // it may be dead already
+        active = next;
+    }
+    *seg = active;
+    *offset = active->size;
+    active->size += len;
+    log->disk_bytes += len;
+    return 0;
+}
+
+void vlog_add_live(ValueLog *log, ValueSegment *seg, size_t len) {
+    seg->live_bytes += len;
+    log->live_bytes += len;
+}
+
+void vlog_del_live(ValueLog *log, ValueSegment *seg, size_t len) {
+    seg->live_bytes -= len;
+    log->live_bytes -= len;
+}
+
+bool vlog_try_drop(ValueLog *log, ValueSegment *seg) {
+    if (seg == log->active || seg->live_bytes || seg->pending_io) {
+        return false;
+    }
+    close(seg->fd);
+    unlink(segment_path(log, seg->id).c_str());
+    log->disk_bytes -= seg->size;
+
+    auto &segs = log->segments;
+    segs.erase(std::find(segs.begin(), segs.end(), seg));
+    delete seg;
+    return true;
+}
+
+ValueSegment *vlog_pick_victim(ValueLog *log, uint32_t live_pct, uint64_t now_ms) {
+    ValueSegment *victim = NULL;
+    for (ValueSegment *seg : log->segments) {
+        if (seg == log->active || !seg->size || now_ms < seg->compact_after_ms) {
+            continue;
+        }
+        if (seg->live_bytes * 100 >= seg->size * live_pct) {
+            continue;
+        }
+        // compare live/size ratios without dividing
+        if (!victim || seg->live_bytes * victim->size < victim->live_bytes * seg->size) {
+            victim = seg;
+        }
+    }
+    return victim;
+}
@@ -0,0 +1,77 @@
+#pragma once
+
+#include <stddef.h>
+#include <stdint.h>
+#include <string>
+#include <string_view>
+#include <vector>
+#include "dlist.h"
+
+/**
+ * Append only files holding string values that were spilled out of memory.
+ *
+ * The log is a series of segment files, values.0, values.1, ... in one
+ * directory. Records are only ever appended to the newest segment, each one
+ * as [u32 key len][u32 value len][key][value] so a segment can be read back
+ * on its own. Space is reserved on the event loop and written by the I/O
+ * pool, so writers never need a lock.
+ *
+ * Nothing is overwritten in place: a value that changes or gets read back
+ * into memory just leaves a dead record behind. Every segment counts the
+ * bytes of its records that are still referenced and keeps the referencing
+ * items in an intrusive list. Compaction copies the live records of a
+ * mostly dead segment to the end of the log, after which the whole file is
+ * unlinked.
+ */
+
+const size_t VLOG_HEADER_SIZE = 8;
+
+struct ValueSegment {
+    uint32_t id = 0;
+    int fd = -1;
+    uint64_t size = 0; // bytes reserved so far, whether written yet or not
+    uint64_t live_bytes = 0; // bytes of the records still referenced
+    uint32_t pending_io = 0; // reads and writes in flight, keeps it open
+    DList records; // the items whose value lives here
+    // set when copying a record out failed, so a bad disk isn't retried
+    // on every loop iteration
+    uint64_t compact_after_ms = 0; // not a victim before this
+    uint64_t compact_backoff_ms = 0; // doubles with each failure in a row
+};
+
+struct ValueLog {
+    std::string dir;
+    uint64_t segment_max = 0;
+    uint32_t next_id = 0;
+    ValueSegment *active = NULL; // the one being appended to
+    std::vector<ValueSegment *> segments;
+    uint64_t disk_bytes = 0; // over all segments
+    uint64_t live_bytes = 0;
+};
+
+// creates dir if needed and opens the first segment. returns -1 on errors.
+int32_t vlog_open(ValueLog *log, const std::string &dir, uint64_t segment_max);
+
+inline size_t vlog_record_size(size_t key_len, size_t val_len) {
+    return VLOG_HEADER_SIZE + key_len + val_len;
+}
+
+// serialises a record into out
+void vlog_record(std::string_view key, std::string_view val, std::string *out);
+
+// reserves len bytes at the end of the log, starting a new segment if the
+// current one is full. returns -1 if that segment can't be created.
+int32_t vlog_reserve(ValueLog *log, size_t len, ValueSegment **seg, uint64_t *offset);
+
+// record accounting, called as items start and stop referencing one
+void vlog_add_live(ValueLog *log, ValueSegment *seg, size_t len);
+void vlog_del_live(ValueLog *log, ValueSegment *seg, size_t len);
+
+// closes and unlinks seg if nothing references it anymore. returns true if
+// it's gone. the active segment is never dropped.
+bool vlog_try_drop(ValueLog *log, ValueSegment *seg);
+
+// the segment with the smallest share of live bytes, if that is below
+// live_pct percent and it isn't backing off at now_ms. NULL if no segment
+// is worth compacting.
+ValueSegment *vlog_pick_victim(ValueLog *log, uint32_t live_pct, uint64_t now_ms);